@@ -0,0 +1,186 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/md5.h>
+
+#include "account.h"
+#include "newcamd.h"
+#include "md5crypt.h"
+#include "crc32.h"
+#include "log.h"
+
+#define ACCOUNT_TABLE_MIN 64
+
+/*
+ * Open addressing hash tables indexing all accounts by CS378x auth token
+ * and by user name. They are filled at startup and only read afterwards.
+ */
+static struct account ** by_token = NULL;
+static struct account ** by_user = NULL;
+static unsigned int table_size = 0;
+static unsigned int table_count = 0;
+
+struct account * account_new(const char * user, const char * pass, const unsigned char * des_key) {
+	struct account * account;
+	unsigned char dump[MD5_DIGEST_LENGTH];
+
+	if ((account = calloc(1, sizeof(struct account))) == NULL) {
+		LOG(ERROR, "[ACCOUNT] Not enough memory for user %s", user);
+		return NULL;
+	}
+
+	account->user = strdup(user);
+	account->pass = strdup(pass);
+	// md5_crypt() returns a static buffer, keep our own copy
+	account->newcamd_pass = strdup(md5_crypt(pass, "$1$abcdefgh$"));
+	if (account->user == NULL || account->pass == NULL || account->newcamd_pass == NULL) {
+		LOG(ERROR, "[ACCOUNT] Not enough memory for user %s", user);
+		account_free(account);
+		return NULL;
+	}
+
+	if (des_key != NULL) {
+		memcpy(account->des_key, des_key, sizeof(account->des_key));
+		newcamd_login_keys(account->des_key, account->newcamd_pass, &account->newcamd_ks1, &account->newcamd_ks2);
+	}
+
+	account->cs378x_token = crc32(0L, MD5((unsigned char *) user, strlen(user), dump), 16);
+	MD5((unsigned char *) pass, strlen(pass), dump);
+	AES_set_encrypt_key(dump, 128, &account->cs378x_encrypt_key);
+	AES_set_decrypt_key(dump, 128, &account->cs378x_decrypt_key);
+
+	return account;
+}
+
+void account_free(struct account * account) {
+	if (account == NULL)
+		return;
+
+	free(account->user);
+	free(account->pass);
+	free(account->newcamd_pass);
+	free(account);
+}
+
+static unsigned int hash_token(uint32_t token) {
+	return (token * 2654435761U) & (table_size - 1);
+}
+
+static unsigned int hash_user(const char * user) {
+	uint32_t h = 2166136261U;
+
+	while (*user)
+		h = (h ^ (unsigned char) *user++) * 16777619U;
+
+	return h & (table_size - 1);
+}
+
+static void table_insert(struct account * account) {
+	unsigned int i;
+
+	for (i = hash_token(account->cs378x_token); by_token[i] != NULL; i = (i + 1) & (table_size - 1));
+	by_token[i] = account;
+
+	for (i = hash_user(account->user); by_user[i] != NULL; i = (i + 1) & (table_size - 1));
+	by_user[i] = account;
+}
+
+static int table_grow(void) {
+	struct account ** old = by_token;
+	unsigned int old_size = table_size;
+	unsigned int i;
+
+	table_size = old_size ? old_size * 2 : ACCOUNT_TABLE_MIN;
+	by_token = calloc(table_size, sizeof(struct account *));
+	free(by_user);
+	by_user = calloc(table_size, sizeof(struct account *));
+	if (by_token == NULL || by_user == NULL) {
+		LOG(ERROR, "[ACCOUNT] Not enough memory for %u accounts", table_count);
+		return -1;
+	}
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i] != NULL)
+			table_insert(old[i]);
+	}
+
+	free(old);
+	return 0;
+}
+
+int account_table_add(const char * user, const char * pass, const unsigned char * des_key) {
+	struct account * account;
+
+	if (account_by_user(user) != NULL) {
+		LOG(ERROR, "[ACCOUNT] User %s is configured twice", user);
+		return -1;
+	}
+
+	if ((account = account_new(user, pass, des_key)) == NULL)
+		return -1;
+
+	if (account_by_token(account->cs378x_token) != NULL) {
+		LOG(ERROR, "[ACCOUNT] CS378x auth token of user %s collides with user %s", user, account_by_token(account->cs378x_token)->user);
+		account_free(account);
+		return -1;
+	}
+
+	if ((table_count + 1) * 2 > table_size && table_grow() < 0) {
+		account_free(account);
+		return -1;
+	}
+
+	table_insert(account);
+	table_count++;
+	return 0;
+}
+
+unsigned int account_table_count(void) {
+	return table_count;
+}
+
+const struct account * account_by_token(uint32_t token) {
+	unsigned int i;
+
+	if (table_size == 0)
+		return NULL;
+
+	for (i = hash_token(token); by_token[i] != NULL; i = (i + 1) & (table_size - 1)) {
+		if (by_token[i]->cs378x_token == token)
+			return by_token[i];
+	}
+	return NULL;
+}
+
+const struct account * account_by_user(const char * user) {
+	unsigned int i;
+
+	if (table_size == 0)
+		return NULL;
+
+	for (i = hash_user(user); by_user[i] != NULL; i = (i + 1) & (table_size - 1)) {
+		if (strcmp(by_user[i]->user, user) == 0)
+			return by_user[i];
+	}
+	return NULL;
+}
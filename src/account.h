@@ -0,0 +1,57 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ACCOUNT_H_
+#define ACCOUNT_H_
+
+#include <stdint.h>
+
+#include <openssl/aes.h>
+#include <openssl/des.h>
+
+/*
+ * Credentials of a Newcamd/CS378x user together with all key material
+ * derived from them. Built once at startup and only read afterwards, so
+ * connections can share it without locking.
+ */
+struct account {
+	char * user;
+	char * pass;
+
+	// Newcamd
+	char * newcamd_pass;		// md5_crypt() of the password as sent on login
+	unsigned char des_key[14];
+	DES_key_schedule newcamd_ks1;	// Session keys after a successful login
+	DES_key_schedule newcamd_ks2;
+
+	// CS378x
+	uint32_t cs378x_token;		// CRC32 of MD5(user)
+	AES_KEY cs378x_encrypt_key;	// Derived from MD5(pass)
+	AES_KEY cs378x_decrypt_key;
+};
+
+struct account * account_new(const char * user, const char * pass, const unsigned char * des_key);
+void account_free(struct account * account);
+
+int account_table_add(const char * user, const char * pass, const unsigned char * des_key);
+unsigned int account_table_count(void);
+const struct account * account_by_token(uint32_t token);
+const struct account * account_by_user(const char * user);
+
+#endif /* ACCOUNT_H_ */
@@ -0,0 +1,160 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "aesdec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <wmmintrin.h>
+#define HAVE_AESNI_KERNEL
+#endif
+
+#define AESDEC_LANES 8
+
+static void aesdec_blocks_scalar(const struct aesdec_key ** keys, unsigned char ** blocks, size_t n);
+
+static void (*aesdec_blocks_impl)(const struct aesdec_key **, unsigned char **, size_t) = aesdec_blocks_scalar;
+static int aesni_enabled = 0;
+
+static void aesdec_blocks_scalar(const struct aesdec_key ** keys, unsigned char ** blocks, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		AES_decrypt(blocks[i], blocks[i], &keys[i]->key);
+}
+
+#ifdef HAVE_AESNI_KERNEL
+#define KEYEXP(k, rcon) aesni_key_expand(k, _mm_aeskeygenassist_si128(k, rcon))
+
+__attribute__((target("aes,sse2")))
+static __m128i aesni_key_expand(__m128i key, __m128i keygened) {
+	keygened = _mm_shuffle_epi32(keygened, _MM_SHUFFLE(3, 3, 3, 3));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, keygened);
+}
+
+/*
+ * Builds the schedule for the equivalent inverse cipher, which is what
+ * AESDEC expects: encryption round keys in reverse order with
+ * InvMixColumns applied to the middle rounds.
+ */
+__attribute__((target("aes,sse2")))
+static void aesni_set_decrypt_key(unsigned char * rk, const unsigned char * user_key) {
+	__m128i ek[11];
+	int i;
+
+	ek[0] = _mm_loadu_si128((const __m128i *) user_key);
+	ek[1] = KEYEXP(ek[0], 0x01);
+	ek[2] = KEYEXP(ek[1], 0x02);
+	ek[3] = KEYEXP(ek[2], 0x04);
+	ek[4] = KEYEXP(ek[3], 0x08);
+	ek[5] = KEYEXP(ek[4], 0x10);
+	ek[6] = KEYEXP(ek[5], 0x20);
+	ek[7] = KEYEXP(ek[6], 0x40);
+	ek[8] = KEYEXP(ek[7], 0x80);
+	ek[9] = KEYEXP(ek[8], 0x1b);
+	ek[10] = KEYEXP(ek[9], 0x36);
+
+	_mm_storeu_si128((__m128i *) rk, ek[10]);
+	for (i = 1; i < 10; i++)
+		_mm_storeu_si128((__m128i *) (rk + i * 16), _mm_aesimc_si128(ek[10 - i]));
+	_mm_storeu_si128((__m128i *) (rk + 160), ek[0]);
+}
+
+/*
+ * Decrypts up to AESDEC_LANES independent blocks, each with its own key.
+ * The rounds of all lanes are interleaved so the AESDEC latency of one
+ * block is hidden behind the others.
+ */
+__attribute__((target("aes,sse2")))
+static inline void aesni_decrypt_lanes(const struct aesdec_key ** keys, unsigned char ** blocks, size_t lanes) {
+	__m128i state[AESDEC_LANES];
+	size_t j;
+	int r;
+
+	for (j = 0; j < lanes; j++)
+		state[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *) blocks[j]), _mm_loadu_si128((const __m128i *) keys[j]->rk));
+
+	for (r = 1; r < 10; r++)
+		for (j = 0; j < lanes; j++)
+			state[j] = _mm_aesdec_si128(state[j], _mm_loadu_si128((const __m128i *) (keys[j]->rk + r * 16)));
+
+	for (j = 0; j < lanes; j++)
+		_mm_storeu_si128((__m128i *) blocks[j], _mm_aesdeclast_si128(state[j], _mm_loadu_si128((const __m128i *) (keys[j]->rk + 160))));
+}
+
+__attribute__((target("aes,sse2")))
+static void aesdec_blocks_aesni(const struct aesdec_key ** keys, unsigned char ** blocks, size_t n) {
+	size_t i;
+
+	for (i = 0; i + AESDEC_LANES <= n; i += AESDEC_LANES)
+		aesni_decrypt_lanes(keys + i, blocks + i, AESDEC_LANES);
+
+	if (i < n)
+		aesni_decrypt_lanes(keys + i, blocks + i, n - i);
+}
+#endif
+
+static int aesni_supported(void) {
+#ifdef HAVE_AESNI_KERNEL
+	static int supported = -1;
+
+	if (supported < 0) {
+		__builtin_cpu_init();
+		supported = __builtin_cpu_supports("aes") ? 1 : 0;
+	}
+	return supported;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Selects the AES-NI kernel when the CPU supports it. Keys always carry
+ * both schedules, so the engine can be switched while keys are loaded.
+ */
+void aesdec_init(int force_scalar) {
+	aesni_enabled = !force_scalar && aesni_supported();
+	aesdec_blocks_impl = aesdec_blocks_scalar;
+#ifdef HAVE_AESNI_KERNEL
+	if (aesni_enabled)
+		aesdec_blocks_impl = aesdec_blocks_aesni;
+#endif
+}
+
+const char * aesdec_engine(void) {
+	return aesni_enabled ? "aesni" : "scalar";
+}
+
+void aesdec_set_key(struct aesdec_key * key, const unsigned char * user_key) {
+	AES_set_decrypt_key(user_key, 128, &key->key);
+#ifdef HAVE_AESNI_KERNEL
+	if (aesni_supported())
+		aesni_set_decrypt_key(key->rk, user_key);
+	else
+#endif
+		memset(key->rk, 0, sizeof(key->rk));
+}
+
+void aesdec_blocks(const struct aesdec_key ** keys, unsigned char ** blocks, size_t n) {
+	aesdec_blocks_impl(keys, blocks, n);
+}
@@ -0,0 +1,37 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+
+#include <openssl/aes.h>
+
+/*
+ * AES-128 decryption key, expanded for both the AES-NI kernel and the
+ * OpenSSL scalar implementation.
+ */
+struct aesdec_key {
+	unsigned char rk[11 * 16];
+	AES_KEY key;
+};
+
+void aesdec_init(int force_scalar);
+const char * aesdec_engine(void);
+
+void aesdec_set_key(struct aesdec_key * key, const unsigned char * user_key);
+void aesdec_blocks(const struct aesdec_key ** keys, unsigned char ** blocks, size_t n);
@@ -0,0 +1,447 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "keyblock.h"
+#include "aesdec.h"
+#include "synth.h"
+#include "server.h"
+#include "account.h"
+#include "cs378x.h"
+#include "newcamd.h"
+#include "md5crypt.h"
+#include "crc32.h"
+#include "log.h"
+
+#define BENCH_CHANNELS 1000
+#define BENCH_ECMS 4096
+#define BENCH_ROUNDS 200000
+#define BENCH_SERVER_REQUESTS 200000
+#define BENCH_MICRO_SAMPLES 2000
+#define BENCH_FRAME_LEN 512
+
+struct bench_client {
+	pthread_t thread;
+	int port;
+	unsigned int depth;
+	unsigned int requests;
+	unsigned int first;
+	unsigned int failed;
+};
+
+struct bench_micro {
+	const char * name;
+	void (*op)(unsigned int i);
+	unsigned int batch;	// Operations per timed sample
+};
+
+static unsigned char ecms[BENCH_ECMS][SYNTH_ECM_LEN];
+
+static struct newcamd micro_newcamd;
+static struct cs378x micro_cs378x;
+static struct sendbuf micro_out;
+static unsigned char micro_frames[2][BENCH_FRAME_LEN];
+static int micro_frame_len[2];
+static volatile uint32_t micro_sink;
+
+static double now_sec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Measures single core ECM throughput of keyblock_analyse_batch() for the
+ * given batch size. ECMs are copied into scratch buffers first because
+ * they are decrypted in place, that copy is part of the measured loop.
+ */
+static double bench_batch(unsigned char (*ecms)[SYNTH_ECM_LEN], unsigned int batch) {
+	unsigned char work[64][SYNTH_ECM_LEN];
+	unsigned char dcw[64][32];
+	struct keyblock_ecm req[64];
+	unsigned int j, done = 0, next = 0;
+	double start;
+
+	for (j = 0; j < batch; j++) {
+		req[j].ecm = work[j];
+		req[j].dcw = dcw[j];
+	}
+
+	start = now_sec();
+	while (done < BENCH_ROUNDS) {
+		for (j = 0; j < batch; j++) {
+			memcpy(work[j], ecms[next], SYNTH_ECM_LEN);
+			next = (next + 1) % BENCH_ECMS;
+		}
+		keyblock_analyse_batch(req, batch);
+		for (j = 0; j < batch; j++) {
+			if (req[j].result != 1) {
+				fprintf(stderr, "ECM decryption failed\n");
+				exit(1);
+			}
+		}
+		done += batch;
+	}
+
+	return done / (now_sec() - start);
+}
+
+/*
+ * CS378x client keeping @depth requests in flight on one connection, so
+ * the server sees several frames per wakeup like from a busy proxy.
+ */
+static void *bench_client_run(void * arg) {
+	struct bench_client * b = arg;
+	struct sockaddr_in addr;
+	struct cs378x c;
+	unsigned char data[CAMD35_BUF_LEN];
+	unsigned int sent = 0, received = 0;
+
+	cs378x_init(&c);
+	c.account = account_by_user("bench");
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(b->port);
+	if ((c.client_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || connect(c.client_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		b->failed = b->requests;
+		return NULL;
+	}
+
+	while (received < b->requests) {
+		while (sent < b->requests && sent - received < b->depth) {
+			memset(data, 0, CAMD35_BUF_LEN);
+			memcpy(data + CAMD35_HDR_LEN, ecms[(b->first + sent) % BENCH_ECMS], SYNTH_ECM_LEN);
+			cs378x_send(&c, data, SYNTH_ECM_LEN);
+			sent++;
+		}
+
+		if (cs378x_recv(&c, data) < 0) {
+			b->failed += b->requests - received;
+			break;
+		}
+		if (data[0] != 0x01)
+			b->failed++;
+		received++;
+	}
+
+	close(c.client_fd);
+	return NULL;
+}
+
+/*
+ * Round trips through a single server worker using the given I/O backend
+ * over loopback, @connections clients with @depth requests in flight each.
+ */
+static int bench_server(const char * name, unsigned int connections, unsigned int depth) {
+	static const unsigned char des_key[14];
+	struct bench_client * clients;
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	unsigned int i, failed = 0;
+	double start, elapsed;
+	int sock;
+
+	if (server_set_backend(strcmp(name, "uring") == 0 ? SERVER_URING : SERVER_EPOLL) < 0) {
+		fprintf(stderr, "Backend %s isn't supported\n", name);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			listen(sock, 1024) < 0 || getsockname(sock, (struct sockaddr *) &addr, &addr_len) < 0) {
+		perror("listen");
+		return -1;
+	}
+
+	if (account_table_add("bench", "bench", des_key) < 0 || server_add_listener(sock, SERVER_CS378X, des_key, -1) < 0 ||
+			server_start(1, 0, 0, keyblock_analyse_batch) < 0)
+		return -1;
+
+	if ((clients = calloc(connections, sizeof(struct bench_client))) == NULL)
+		return -1;
+
+	start = now_sec();
+	for (i = 0; i < connections; i++) {
+		clients[i].port = ntohs(addr.sin_port);
+		clients[i].depth = depth;
+		clients[i].requests = BENCH_SERVER_REQUESTS / connections;
+		clients[i].first = i * 97;
+		pthread_create(&clients[i].thread, NULL, bench_client_run, &clients[i]);
+	}
+	for (i = 0; i < connections; i++) {
+		pthread_join(clients[i].thread, NULL);
+		failed += clients[i].failed;
+	}
+	elapsed = now_sec() - start;
+
+	printf("Server %s, %u connections, depth %u: %10.0f requests/sec, %u failed\n", name, connections, depth,
+			(BENCH_SERVER_REQUESTS / connections) * connections / elapsed, failed);
+	free(clients);
+	return failed == 0 ? 0 : -1;
+}
+
+static int make_ecms(const unsigned char * keyblock) {
+	unsigned char mkey[16], cw[32], work[SYNTH_ECM_LEN], dcw[32];
+	uint64_t rng = 0x766d63616d;
+	uint16_t channel;
+	unsigned int i, j;
+
+	for (i = 0; i < BENCH_ECMS; i++) {
+		synth_keyblock_mkey(keyblock, synth_rand(&rng) % BENCH_CHANNELS, time(NULL), &channel, mkey);
+		for (j = 0; j < 32; j++)
+			cw[j] = synth_rand(&rng);
+		synth_ecm(ecms[i], mkey, channel, 0x80 | (i & 1), cw);
+
+		memcpy(work, ecms[i], SYNTH_ECM_LEN);
+		if (keyblock_analyse(dcw, work) != 1 || memcmp(dcw, cw, 32) != 0) {
+			fprintf(stderr, "Synthetic ECM %u doesn't decrypt to its control words\n", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void micro_keyblock(unsigned int i) {
+	unsigned char work[SYNTH_ECM_LEN], dcw[32];
+
+	memcpy(work, ecms[i % BENCH_ECMS], SYNTH_ECM_LEN);
+	if (keyblock_analyse(dcw, work) != 1) {
+		fprintf(stderr, "ECM decryption failed\n");
+		exit(1);
+	}
+}
+
+static void micro_newcamd_send(unsigned int i) {
+	unsigned char data[BENCH_FRAME_LEN];
+
+	memcpy(data, ecms[i % BENCH_ECMS], SYNTH_ECM_LEN);
+	micro_out.len = 0;
+	newcamd_send(&micro_newcamd, data, SYNTH_ECM_LEN, 1, i, 0);
+}
+
+static void micro_newcamd_recv(unsigned int i) {
+	unsigned char work[BENCH_FRAME_LEN], data[BENCH_FRAME_LEN];
+	uint16_t service_id, msg_id;
+	uint32_t provider_id;
+	int len;
+
+	(void) i;
+
+	memcpy(work, micro_frames[0], micro_frame_len[0]);
+	if ((len = newcamd_frame_len(work, micro_frame_len[0])) != micro_frame_len[0] ||
+			newcamd_decode(&micro_newcamd, work + 2, len - 2, data, &service_id, &msg_id, &provider_id) != SYNTH_ECM_LEN) {
+		fprintf(stderr, "Newcamd frame didn't decode\n");
+		exit(1);
+	}
+}
+
+static void micro_cs378x_send(unsigned int i) {
+	unsigned char data[CAMD35_BUF_LEN];
+
+	memset(data, 0, CAMD35_HDR_LEN);
+	memcpy(data + CAMD35_HDR_LEN, ecms[i % BENCH_ECMS], SYNTH_ECM_LEN);
+	micro_out.len = 0;
+	cs378x_send(&micro_cs378x, data, SYNTH_ECM_LEN);
+}
+
+static void micro_cs378x_recv(unsigned int i) {
+	unsigned char data[CAMD35_BUF_LEN];
+	int len;
+
+	(void) i;
+
+	if ((len = cs378x_frame_len(&micro_cs378x, micro_frames[1], micro_frame_len[1])) != micro_frame_len[1] ||
+			cs378x_decode(&micro_cs378x, micro_frames[1], len, data) < CAMD35_HDR_LEN + SYNTH_ECM_LEN) {
+		fprintf(stderr, "CS378x frame didn't decode\n");
+		exit(1);
+	}
+}
+
+static void micro_md5_crypt(unsigned int i) {
+	(void) i;
+	md5_crypt("bench", "$1$abcdefgh$");
+}
+
+static void micro_crc32(unsigned int i) {
+	micro_sink = crc32(0L, ecms[i % BENCH_ECMS], SYNTH_ECM_LEN);
+}
+
+static int compare_double(const void * a, const void * b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Times BENCH_MICRO_SAMPLES batches of @m->op after a warm up, the
+ * percentiles are over the per operation time of each batch.
+ */
+static void micro_run(const struct bench_micro * m, int last) {
+	static double samples[BENCH_MICRO_SAMPLES];
+	unsigned int i, j, n = 0;
+	double start, total = 0;
+
+	for (i = 0; i < m->batch * 16; i++)
+		m->op(n++);
+
+	for (i = 0; i < BENCH_MICRO_SAMPLES; i++) {
+		start = now_sec();
+		for (j = 0; j < m->batch; j++)
+			m->op(n++);
+		samples[i] = (now_sec() - start) * 1e9 / m->batch;
+		total += samples[i];
+	}
+	qsort(samples, BENCH_MICRO_SAMPLES, sizeof(double), compare_double);
+
+	printf("    {\"name\": \"%s\", \"ops\": %u, \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, \"p50_ns\": %.1f, \"p99_ns\": %.1f}%s\n",
+			m->name, BENCH_MICRO_SAMPLES * m->batch, total / BENCH_MICRO_SAMPLES, 1e9 * BENCH_MICRO_SAMPLES / total,
+			samples[BENCH_MICRO_SAMPLES / 2], samples[BENCH_MICRO_SAMPLES * 99 / 100], last ? "" : ",");
+}
+
+/*
+ * Runs the hot path microbenchmarks and prints the results as JSON. The
+ * protocol benchmarks use the buffer encoders and decoders the server
+ * workers use, so no socket I/O is measured.
+ */
+static int bench_micro(void) {
+	static const unsigned char des_key[14] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x10, 0x11, 0x12, 0x13, 0x14};
+	static const struct bench_micro micros[] = {
+		{"keyblock_analyse", micro_keyblock, 64},
+		{"newcamd_send", micro_newcamd_send, 64},
+		{"newcamd_recv", micro_newcamd_recv, 64},
+		{"cs378x_send", micro_cs378x_send, 64},
+		{"cs378x_recv", micro_cs378x_recv, 64},
+		{"md5_crypt", micro_md5_crypt, 4},
+		{"crc32", micro_crc32, 64},
+	};
+	const unsigned int count = sizeof(micros) / sizeof(micros[0]);
+	unsigned char out[BENCH_FRAME_LEN];
+	unsigned int i;
+
+	if (account_table_add("bench", "bench", des_key) < 0)
+		return -1;
+
+	micro_out.data = out;
+	micro_out.size = sizeof(out);
+
+	memset(&micro_newcamd, 0, sizeof(micro_newcamd));
+	micro_newcamd.client_fd = -1;
+	micro_newcamd.account = account_by_user("bench");
+	micro_newcamd.out = &micro_out;
+	micro_newcamd.ks1 = micro_newcamd.account->newcamd_ks1;
+	micro_newcamd.ks2 = micro_newcamd.account->newcamd_ks2;
+
+	cs378x_init(&micro_cs378x);
+	micro_cs378x.client_fd = -1;
+	micro_cs378x.account = micro_newcamd.account;
+	micro_cs378x.out = &micro_out;
+
+	// Frames for the receive benchmarks
+	micro_newcamd_send(0);
+	memcpy(micro_frames[0], out, micro_frame_len[0] = micro_out.len);
+	micro_cs378x_send(0);
+	memcpy(micro_frames[1], out, micro_frame_len[1] = micro_out.len);
+
+	printf("{\n  \"engine\": \"%s\",\n  \"benchmarks\": [\n", aesdec_engine());
+	for (i = 0; i < count; i++)
+		micro_run(&micros[i], i == count - 1);
+	printf("  ]\n}\n");
+	return 0;
+}
+
+/*
+ * Without arguments the ECM decryption engines are compared, with
+ * -server epoll|uring [connections] [depth] the server I/O backends and
+ * with -micro the hot path microbenchmarks are reported as JSON.
+ */
+int main(int argc, char *argv[]) {
+	unsigned char * keyblock;
+	size_t len;
+	unsigned int batch;
+	int engine, mode = 0, usage = 0;
+
+	debug_level = ERROR;
+	if (argc >= 3 && strcmp(argv[1], "-server") == 0) {
+		mode = 1;
+		usage = argc > 5 || (strcmp(argv[2], "epoll") != 0 && strcmp(argv[2], "uring") != 0);
+	} else if (argc == 2 && strcmp(argv[1], "-micro") == 0) {
+		mode = 2;
+	} else {
+		usage = argc > 1;
+	}
+
+	if (usage) {
+		printf("Usage: vmcam-bench [options]\n\n");
+		printf("Without options the ECM decryption engines are compared.\n\n");
+		printf("\t-server [epoll|uring] [conns] [depth]\tServer throughput with one I/O backend [default: 16 8]\n");
+		printf("\t-micro\t\t\t\t\tHot path microbenchmarks as JSON\n");
+		return EXIT_FAILURE;
+	}
+
+	if ((keyblock = synth_keyblock(BENCH_CHANNELS, 1000, 1, &len)) == NULL)
+		return EXIT_FAILURE;
+
+	if (mode == 1) {
+		aesdec_init(0);
+		keyblock_load(keyblock, len);
+		if (make_ecms(keyblock) < 0)
+			return EXIT_FAILURE;
+
+		return bench_server(argv[2], argc > 3 ? atoi(argv[3]) : 16, argc > 4 ? atoi(argv[4]) : 8) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (mode == 2) {
+		aesdec_init(0);
+		keyblock_load(keyblock, len);
+		if (make_ecms(keyblock) < 0)
+			return EXIT_FAILURE;
+
+		return bench_micro() < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	for (engine = 0; engine < 2; engine++) {
+		aesdec_init(engine);
+		if (engine == 0 && strcmp(aesdec_engine(), "aesni") != 0)
+			continue;
+
+		keyblock_load(keyblock, len);
+		if (make_ecms(keyblock) < 0)
+			return EXIT_FAILURE;
+
+		printf("Engine %s\n", aesdec_engine());
+		for (batch = 1; batch <= 64; batch *= 2)
+			printf("  batch %2u: %10.0f ECMs/sec\n", batch, bench_batch(ecms, batch));
+	}
+
+	free(keyblock);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "capture.h"
+#include "log.h"
+
+#define CAPTURE_BUF (64 * 1024)
+
+/*
+ * Records incoming ECM requests to an ECM file for later replay. Workers
+ * append under a lock to a buffered stream, which is flushed about once a
+ * second so a capture is usable while vmcam runs.
+ */
+static FILE * capture;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec capture_start;
+static uint32_t capture_flushed;
+
+static void capture_close(void) {
+	pthread_mutex_lock(&capture_lock);
+	if (capture != NULL)
+		fclose(capture);
+	capture = NULL;
+	pthread_mutex_unlock(&capture_lock);
+}
+
+int capture_open(const char * path) {
+	if ((capture = ecmfile_create(path)) == NULL)
+		return -1;
+
+	setvbuf(capture, NULL, _IOFBF, CAPTURE_BUF);
+	clock_gettime(CLOCK_MONOTONIC, &capture_start);
+	atexit(capture_close);
+
+	LOG(INFO, "[CAPTURE] Recording ECM requests to %s", path);
+	return 0;
+}
+
+void capture_ecm(enum ecmfile_protocol protocol, const char * user, uint16_t service_id, uint32_t provider_id, const unsigned char * ecm, int len) {
+	struct ecmfile_record record;
+	struct timespec now;
+
+	if (capture == NULL || len <= 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record.time_ms = (now.tv_sec - capture_start.tv_sec) * 1000 + (now.tv_nsec - capture_start.tv_nsec) / 1000000;
+	record.len = len < ECMFILE_MAX_ECM ? len : ECMFILE_MAX_ECM;
+	record.flags = ECMFILE_HAS_META;
+	record.protocol = protocol;
+	record.service_id = service_id;
+	record.provider_id = provider_id;
+	snprintf(record.user, sizeof(record.user), "%s", user);
+	memcpy(record.ecm, ecm, record.len);
+
+	pthread_mutex_lock(&capture_lock);
+	if (capture != NULL) {
+		if (ecmfile_write(capture, &record) < 0) {
+			LOG(ERROR, "[CAPTURE] Could not write capture, stopped recording");
+			fclose(capture);
+			capture = NULL;
+		} else if (record.time_ms / 1000 != capture_flushed) {
+			capture_flushed = record.time_ms / 1000;
+			fflush(capture);
+		}
+	}
+	pthread_mutex_unlock(&capture_lock);
+}
@@ -20,15 +20,13 @@
 
 #include <string.h>
 #include <stdio.h>
-
-#include <openssl/md5.h>
+#include <unistd.h>
 
 #include "crc32.h"
 #include "cs378x.h"
+#include "capture.h"
 #include "log.h"
-
-#define CAMD35_HDR_LEN (20)
-#define CAMD35_BUF_LEN (CAMD35_HDR_LEN + 256 + 16)
+#include "var_func.h"
 
 int32_t boundary(int32_t exp, int32_t n) {
 	return ((((n - 1) >> exp) + 1) << exp);
@@ -47,102 +45,155 @@ uint8_t *init_2b(uint32_t val, uint8_t *b) {
 	return b;
 }
 
-static void print_hex(char* msg, unsigned char* data, int length) {
-	int i;
-	if (VERBOSE <= debug_level) {
-		printf("[CS378x] %s", msg);
-		for (i = 0; i < length; i++)
-			printf(" %02x", data[i]);
+int cs378x_init(struct cs378x *c) {
+	c->out = NULL;
+	c->account = NULL;
+	return 0;
+}
 
-		printf("\n");
-	}
+static uint32_t cs378x_token(const unsigned char* buffer) {
+	return (((buffer[0] << 24) | (buffer[1] << 16) | (buffer[2]<<8) | buffer[3]) & 0xffffffffL);
 }
 
-int cs378x_init(struct cs378x *c, const unsigned char* user, const unsigned char* pass) {
-	unsigned char dump[16];
-	
-	c->auth_token = crc32(0L, MD5((unsigned char *)user, strlen(user), dump), 16);
-	MD5((unsigned char *)pass, strlen(pass), dump);
+/*
+ * Decrypts @frame in place, the message is left behind the auth token for
+ * cs378x_handle(). Returns the length of the ECM section when the message
+ * is an ECM, which gets pointed to by @ecm, 0 for other messages and -1
+ * when the connection has to be closed.
+ */
+int cs378x_parse(struct cs378x *c, unsigned char* frame, int frame_len, unsigned char** ecm) {
+	unsigned char* data = frame + 4;
+	int data_len;
 
-	AES_set_encrypt_key(dump, 128, &c->aes_encrypt_key);
-	AES_set_decrypt_key(dump, 128, &c->aes_decrypt_key);
+	if ((data_len = cs378x_decode(c, frame, frame_len, data)) == -1)
+		return -1;
+
+	if (data[0] != 0x00)
+		return 0;
+
+	short service_id = (data[8] << 8) | data[9];
+	short ca_id = (data[10] << 8) | data[11];
+	int provider_id = (((data[12] << 24) | (data[13] << 16) | (data[14]<<8) | data[15]) & 0xffffffffL);
+	short message_id = (data[16] << 8) | data[17];
+	LOG(DEBUG, "[CS378x] Requestmessage serviceid: %d, caid: %d, providerid: %d, msgid: %d", service_id, ca_id, provider_id, message_id);
+
+	data_len -= CAMD35_HDR_LEN;
+	if (data[1] < data_len)
+		data_len = data[1];
+
+	capture_ecm(ECMFILE_CS378X, c->account->user, service_id, provider_id, data + CAMD35_HDR_LEN, data_len);
+	*ecm = data + CAMD35_HDR_LEN;
+	return data_len;
 }
 
-int cs378x_handle(struct cs378x *c, int32_t (*f)(unsigned char*, unsigned char*)) {
+/*
+ * Answers a message decoded by cs378x_parse(), @dcw holds the control
+ * words for an ECM.
+ */
+int cs378x_handle(struct cs378x *c, unsigned char* frame, const unsigned char* dcw) {
 	unsigned char data[CAMD35_BUF_LEN];
-	unsigned char dcw[32];
+	const unsigned char* req = frame + 4;
 	int data_len;
-	
-	if (cs378x_recv(c, data) == -1)
+
+	if (req[0] != 0x00)
+		return 0;
+
+	// The reply goes out under the token of the request, later frames may have switched accounts
+	if (cs378x_token(frame) != c->account->cs378x_token && (c->account = account_by_token(cs378x_token(frame))) == NULL)
 		return -1;
 
-	if (data[0] == 0x00) {
-		short service_id = (data[8] << 8) | data[9];
-		short ca_id = (data[10] << 8) | data[11];
-		int provider_id = (((data[12] << 24) | (data[13] << 16) | (data[14]<<8) | data[15]) & 0xffffffffL);
-		short message_id = (data[16] << 8) | data[17];
-		LOG(DEBUG, "[CS378x] Requestmessage serviceid: %d, caid: %d, providerid: %d, msgid: %d, length: %d", service_id, ca_id, provider_id, message_id);
-		
-		f(dcw, data+CAMD35_HDR_LEN);
-		
-		memset(data, 0, CAMD35_HDR_LEN);
-		memset(data + CAMD35_HDR_LEN, 0xff, CAMD35_BUF_LEN - CAMD35_HDR_LEN);
-		
-		data_len = 32;
-		data[0] = 0x01;
-		init_2b(service_id, data + 8);
-		init_2b(ca_id, data + 10);
-		init_4b(provider_id, data + 12);
-		init_2b(message_id, data + 16);
-		memcpy(data + CAMD35_HDR_LEN, dcw, data_len);
-		
-		cs378x_send(c, data, data_len);
+	memset(data, 0, CAMD35_HDR_LEN);
+	memset(data + CAMD35_HDR_LEN, 0xff, CAMD35_BUF_LEN - CAMD35_HDR_LEN);
+
+	data_len = 32;
+	data[0] = 0x01;
+	memcpy(data + 8, req + 8, 10); // Service, CA, provider and message id
+	memcpy(data + CAMD35_HDR_LEN, dcw, data_len);
+
+	cs378x_send(c, data, data_len);
+	return 0;
+}
+
+/*
+ * Returns the number of bytes needed for the frame at @buffer. The length
+ * is only known after decrypting the first AES block, until then the size
+ * of the auth token and one block is returned.
+ */
+int cs378x_frame_len(struct cs378x *c, const unsigned char* buffer, int len) {
+	unsigned char block[16];
+	uint32_t auth_token;
+
+	if (len < 4 + 16)
+		return 4 + 16;
+
+	// Every frame carries the token of its user, only look it up when it changes
+	auth_token = cs378x_token(buffer);
+	if (c->account == NULL || auth_token != c->account->cs378x_token) {
+		if ((c->account = account_by_token(auth_token)) == NULL) {
+			LOG(ERROR, "[CS378x] Auth key is not valid %u", auth_token);
+			return -1;
+		}
 	}
+
+	AES_decrypt(buffer + 4, block, &c->account->cs378x_decrypt_key);
+	return 4 + boundary(4, block[1] + CAMD35_HDR_LEN);
 }
 
-int cs378x_recv(struct cs378x *c, unsigned char* data) {
-	int ret;
-	int data_len = 256;
+int cs378x_decode(struct cs378x *c, const unsigned char* frame, int frame_len, unsigned char* data) {
+	int data_len = frame_len - 4;
 	int i;
-	uint32_t auth_token;
-	
-	if (!read(c->client_fd, data, 4))
+
+	if (data_len <= 0 || data_len > CAMD35_BUF_LEN || c->account == NULL || cs378x_token(frame) != c->account->cs378x_token)
 		return -1;
-	
-	auth_token = (((data[0] << 24) | (data[1] << 16) | (data[2]<<8) | data[3]) & 0xffffffffL);
 
-	if (auth_token != c->auth_token) {
-		LOG(ERROR, "[CS378x] Auth key is not valid %u != %u", auth_token, c->auth_token);
+	for (i = 0; i < data_len; i += 16) // Decrypt payload
+		AES_decrypt(frame + 4 + i, data + i, &c->account->cs378x_decrypt_key);
+
+	LOG_HEX(VERBOSE, "[CS378x] received data", data, data_len);
+	return data_len;
+}
+
+int cs378x_recv(struct cs378x *c, unsigned char* data) {
+	unsigned char frame[4 + CAMD35_BUF_LEN];
+	int len;
+
+	if (read_full(c->client_fd, frame, 4 + 16) == -1)
+		return -1;
+
+	if ((len = cs378x_frame_len(c, frame, 4 + 16)) == -1)
+		return -1;
+
+	if (len > 4 + 16 && read_full(c->client_fd, frame + 4 + 16, len - 4 - 16) == -1)
 		return -1;
-	}
-	
-	for (i = 0; i < data_len; i += 16) { // Read and decrypt payload
-		if (!read(c->client_fd, (char *)data + i, 16))
-			return -1;
-		
-		AES_decrypt(data + i, data + i, &c->aes_decrypt_key);
-		if (i == 0)
-			data_len = boundary(4, data[1] + 20); // Initialize real data length
-	}
 
-	print_hex("received data", data, data_len);
+	return cs378x_decode(c, frame, len, data);
 }
 
 int cs378x_send(struct cs378x *c, unsigned char* data, int data_len) {
-	unsigned char token[4];
-	int i;
-	
-	init_4b(c->auth_token, token);
-	write(c->client_fd, token, 4);
-		
+	unsigned char local[4 + CAMD35_BUF_LEN];
+	unsigned char * buffer = local;
+	int i, frame_len;
+
+	// Encode straight into the connection's output buffer when it has room
+	if (c->out != NULL && c->out->size - c->out->len >= (int) sizeof(local))
+		buffer = c->out->data + c->out->len;
+
+	init_4b(c->account->cs378x_token, buffer);
+
 	data[1] = data_len;
-	print_hex("sended data", data, data_len + CAMD35_HDR_LEN);
+	LOG_HEX(VERBOSE, "[CS378x] sended data", data, data_len + CAMD35_HDR_LEN);
 
 	init_4b(crc32(0L, data + CAMD35_HDR_LEN, data_len), data + 4);
-		
+
 	data_len += CAMD35_HDR_LEN;
+	frame_len = boundary(4, data_len);
 	for (i = 0; i < data_len; i += 16) // Encrypt payload
-		AES_encrypt(data + i, data + i, &c->aes_encrypt_key);
-		
-	write(c->client_fd, data, boundary(4, data_len));
-}
\ No newline at end of file
+		AES_encrypt(data + i, buffer + 4 + i, &c->account->cs378x_encrypt_key);
+
+	if (buffer != local) {
+		c->out->len += 4 + frame_len;
+		return 4 + frame_len;
+	}
+
+	return write(c->client_fd, buffer, 4 + frame_len);
+}
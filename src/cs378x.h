@@ -21,16 +21,24 @@
 
 #include <openssl/aes.h>
 
+#include "sendbuf.h"
+#include "account.h"
+
+#define CAMD35_HDR_LEN (20)
+#define CAMD35_BUF_LEN (CAMD35_HDR_LEN + 256 + 16)
+
 struct cs378x {
 	int client_fd;
-	AES_KEY aes_encrypt_key;
-	AES_KEY aes_decrypt_key;
-	uint32_t auth_token;
+	const struct account* account;
 	uint16_t msg_id;
+	struct sendbuf* out;
 };
 
-int cs378x_init(struct cs378x *c, const unsigned char* user, const unsigned char* pass);
-int cs378x_handle(struct cs378x *c, int32_t (*f)(unsigned char*, unsigned char*));
+int cs378x_init(struct cs378x *c);
+int cs378x_parse(struct cs378x *c, unsigned char* frame, int frame_len, unsigned char** ecm);
+int cs378x_handle(struct cs378x *c, unsigned char* frame, const unsigned char* dcw);
 
+int cs378x_frame_len(struct cs378x *c, const unsigned char* buffer, int len);
+int cs378x_decode(struct cs378x *c, const unsigned char* frame, int frame_len, unsigned char* data);
 int cs378x_recv(struct cs378x *c, unsigned char* data);
 int cs378x_send(struct cs378x *c, unsigned char* data, int data_len);
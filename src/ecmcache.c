@@ -0,0 +1,226 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ecmcache.h"
+#include "log.h"
+
+#define ECM_CACHE_SHARDS 64
+#define ECM_CACHE_WAYS 4
+
+struct ecm_cache_slot {
+	uint64_t hash;
+	uint32_t generation;
+	time_t expire;
+	unsigned char key[ECM_CACHE_KEY_LEN];
+	unsigned char dcw[32];
+};
+
+/*
+ * The cache is split in shards, each guarded by its own lock. Within a
+ * shard entries live in small set associative buckets, so an insert only
+ * has to look at ECM_CACHE_WAYS slots.
+ */
+struct ecm_cache_shard {
+	pthread_mutex_t lock;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t inserts;
+	uint64_t evictions;
+	struct ecm_cache_slot * slots;
+} __attribute__((aligned(64)));
+
+static struct ecm_cache_shard shards[ECM_CACHE_SHARDS];
+static uint32_t sets_per_shard = 0;
+static unsigned int cache_ttl = 0;
+static uint32_t cache_generation = 1;
+
+static time_t coarse_time(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+static uint64_t hash_bytes(const unsigned char * data, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	uint64_t w;
+
+	for (; len >= 8; data += 8, len -= 8) {
+		memcpy(&w, data, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	for (; len > 0; data++, len--)
+		h = (h ^ *data) * 0x100000001b3ULL;
+
+	h ^= h >> 32;
+	h *= 0xd6e8feb86659fd93ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+int ecm_cache_init(unsigned int size, unsigned int ttl) {
+	int i;
+
+	if (size == 0 || ttl == 0) {
+		LOG(INFO, "[CACHE] ECM cache disabled");
+		return 0;
+	}
+
+	sets_per_shard = size / (ECM_CACHE_SHARDS * ECM_CACHE_WAYS);
+	if (sets_per_shard == 0)
+		sets_per_shard = 1;
+
+	for (i = 0; i < ECM_CACHE_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		shards[i].slots = calloc(sets_per_shard * ECM_CACHE_WAYS, sizeof(struct ecm_cache_slot));
+		if (shards[i].slots == NULL) {
+			LOG(ERROR, "[CACHE] Not enough memory for ECM cache");
+			sets_per_shard = 0;
+			return -1;
+		}
+	}
+
+	cache_ttl = ttl;
+	LOG(INFO, "[CACHE] ECM cache with %u entries, TTL %u seconds", sets_per_shard * ECM_CACHE_SHARDS * ECM_CACHE_WAYS, ttl);
+	return 0;
+}
+
+/*
+ * Entries from an older generation are treated as empty, so a new keyblock
+ * drops all cached control words without walking the shards.
+ */
+void ecm_cache_invalidate(void) {
+	__atomic_fetch_add(&cache_generation, 1, __ATOMIC_RELEASE);
+}
+
+void ecm_cache_stats(struct ecm_cache_stats * stats) {
+	int i;
+
+	memset(stats, 0, sizeof(struct ecm_cache_stats));
+	if (sets_per_shard == 0)
+		return;
+
+	for (i = 0; i < ECM_CACHE_SHARDS; i++) {
+		pthread_mutex_lock(&shards[i].lock);
+		stats->hits += shards[i].hits;
+		stats->misses += shards[i].misses;
+		stats->inserts += shards[i].inserts;
+		stats->evictions += shards[i].evictions;
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+	stats->slots = sets_per_shard * ECM_CACHE_SHARDS * ECM_CACHE_WAYS;
+}
+
+void ecm_cache_key(struct ecm_cache_key * key, const unsigned char * ECM) {
+	key->data[0] = ECM[0];
+	key->data[1] = ECM[18];
+	key->data[2] = ECM[19];
+	memcpy(key->data + 3, ECM + 24, 48);
+	key->hash = hash_bytes(key->data, ECM_CACHE_KEY_LEN);
+	key->generation = __atomic_load_n(&cache_generation, __ATOMIC_ACQUIRE);
+}
+
+static struct ecm_cache_shard * shard_of(const struct ecm_cache_key * key, struct ecm_cache_slot ** set) {
+	struct ecm_cache_shard * shard = &shards[key->hash >> 58];
+
+	*set = shard->slots + ((key->hash & 0xffffffff) % sets_per_shard) * ECM_CACHE_WAYS;
+	return shard;
+}
+
+int ecm_cache_get(const struct ecm_cache_key * key, unsigned char * dcw) {
+	struct ecm_cache_shard * shard;
+	struct ecm_cache_slot * set;
+	uint32_t generation = key->generation;
+	time_t now;
+	int i, found = 0;
+
+	if (sets_per_shard == 0)
+		return 0;
+
+	now = coarse_time();
+	shard = shard_of(key, &set);
+
+	pthread_mutex_lock(&shard->lock);
+	for (i = 0; i < ECM_CACHE_WAYS; i++) {
+		if (set[i].hash == key->hash && set[i].generation == generation && set[i].expire > now &&
+				memcmp(set[i].key, key->data, ECM_CACHE_KEY_LEN) == 0) {
+			memcpy(dcw, set[i].dcw, 32);
+			found = 1;
+			break;
+		}
+	}
+	if (found)
+		shard->hits++;
+	else
+		shard->misses++;
+	pthread_mutex_unlock(&shard->lock);
+
+	return found;
+}
+
+/*
+ * Stores @dcw under the generation @key was looked up with, so a control
+ * word decrypted with a keyblock that was replaced in the meantime is
+ * dropped instead of outliving the invalidation. An ECM always decrypts
+ * to the same control words, a new crypto period comes with a new ECM,
+ * so the TTL only bounds the memory of old ECMs. It's cut short at
+ * @valid, the expiry of the master key used.
+ */
+void ecm_cache_put(const struct ecm_cache_key * key, const unsigned char * dcw, time_t valid) {
+	struct ecm_cache_shard * shard;
+	struct ecm_cache_slot * set;
+	struct ecm_cache_slot * victim;
+	uint32_t generation = key->generation;
+	time_t now;
+	int i;
+
+	if (sets_per_shard == 0 || generation != __atomic_load_n(&cache_generation, __ATOMIC_ACQUIRE))
+		return;
+
+	now = coarse_time();
+	shard = shard_of(key, &set);
+
+	pthread_mutex_lock(&shard->lock);
+	victim = &set[0];
+	for (i = 0; i < ECM_CACHE_WAYS; i++) {
+		if (set[i].generation != generation || set[i].expire <= now || set[i].hash == key->hash) {
+			victim = &set[i];
+			break;
+		}
+		if (set[i].expire < victim->expire)
+			victim = &set[i];
+	}
+	if (i == ECM_CACHE_WAYS)
+		shard->evictions++;
+
+	victim->hash = key->hash;
+	victim->generation = generation;
+	victim->expire = valid < now + cache_ttl ? valid : now + cache_ttl;
+	memcpy(victim->key, key->data, ECM_CACHE_KEY_LEN);
+	memcpy(victim->dcw, dcw, 32);
+	shard->inserts++;
+	pthread_mutex_unlock(&shard->lock);
+}
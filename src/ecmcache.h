@@ -0,0 +1,45 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#define ECM_CACHE_KEY_LEN 51 // Table id, channel id and the encrypted block
+
+struct ecm_cache_key {
+	uint64_t hash;
+	uint32_t generation;	// Cache generation when the ECM was looked up
+	unsigned char data[ECM_CACHE_KEY_LEN];
+};
+
+struct ecm_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t inserts;
+	uint64_t evictions;
+	uint32_t slots;
+};
+
+int ecm_cache_init(unsigned int size, unsigned int ttl);
+void ecm_cache_invalidate(void);
+void ecm_cache_stats(struct ecm_cache_stats * stats);
+
+void ecm_cache_key(struct ecm_cache_key * key, const unsigned char * ECM);
+int ecm_cache_get(const struct ecm_cache_key * key, unsigned char * dcw);
+void ecm_cache_put(const struct ecm_cache_key * key, const unsigned char * dcw, time_t valid);
@@ -0,0 +1,137 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "ecmfile.h"
+#include "log.h"
+
+#define ECMFILE_HDR_LEN 8
+
+FILE * ecmfile_create(const char * path) {
+	FILE * f;
+
+	if ((f = fopen(path, "wb")) == NULL) {
+		LOG(ERROR, "[ECMFILE] Could not create %s", path);
+		return NULL;
+	}
+
+	if (fwrite(ECMFILE_MAGIC, ECMFILE_HDR_LEN, 1, f) != 1) {
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+FILE * ecmfile_open(const char * path) {
+	char magic[ECMFILE_HDR_LEN];
+	FILE * f;
+
+	if ((f = fopen(path, "rb")) == NULL) {
+		LOG(ERROR, "[ECMFILE] Could not open %s", path);
+		return NULL;
+	}
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, ECMFILE_MAGIC, sizeof(magic)) != 0) {
+		LOG(ERROR, "[ECMFILE] %s is not an ECM file", path);
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+int ecmfile_write(FILE * f, const struct ecmfile_record * record) {
+	unsigned char hdr[8], meta[8];
+	size_t user_len = 0;
+
+	if (record->len > ECMFILE_MAX_ECM)
+		return -1;
+
+	hdr[0] = record->time_ms & 0xff;
+	hdr[1] = (record->time_ms >> 8) & 0xff;
+	hdr[2] = (record->time_ms >> 16) & 0xff;
+	hdr[3] = (record->time_ms >> 24) & 0xff;
+	hdr[4] = record->len & 0xff;
+	hdr[5] = record->len >> 8;
+	hdr[6] = record->flags;
+	hdr[7] = 0;
+
+	if (fwrite(hdr, sizeof(hdr), 1, f) != 1)
+		return -1;
+
+	if (record->flags & ECMFILE_HAS_META) {
+		user_len = strnlen(record->user, ECMFILE_MAX_USER - 1);
+		meta[0] = record->protocol;
+		meta[1] = user_len;
+		meta[2] = record->service_id & 0xff;
+		meta[3] = record->service_id >> 8;
+		meta[4] = record->provider_id & 0xff;
+		meta[5] = (record->provider_id >> 8) & 0xff;
+		meta[6] = (record->provider_id >> 16) & 0xff;
+		meta[7] = (record->provider_id >> 24) & 0xff;
+		if (fwrite(meta, sizeof(meta), 1, f) != 1 || (user_len > 0 && fwrite(record->user, user_len, 1, f) != 1))
+			return -1;
+	}
+
+	if (fwrite(record->ecm, record->len, 1, f) != 1)
+		return -1;
+	if ((record->flags & ECMFILE_HAS_CW) && fwrite(record->cw, 32, 1, f) != 1)
+		return -1;
+	return 0;
+}
+
+/*
+ * Returns 1 when a record was read, 0 at the end of the file and -1 for
+ * a truncated or invalid record.
+ */
+int ecmfile_read(FILE * f, struct ecmfile_record * record) {
+	unsigned char hdr[8], meta[8];
+	size_t n;
+
+	if ((n = fread(hdr, 1, sizeof(hdr), f)) == 0)
+		return 0;
+	if (n != sizeof(hdr))
+		return -1;
+
+	record->time_ms = hdr[0] | hdr[1] << 8 | hdr[2] << 16 | (uint32_t) hdr[3] << 24;
+	record->len = hdr[4] | hdr[5] << 8;
+	record->flags = hdr[6];
+	record->protocol = 0;
+	record->service_id = 0;
+	record->provider_id = 0;
+	record->user[0] = '\0';
+
+	if (record->flags & ECMFILE_HAS_META) {
+		if (fread(meta, sizeof(meta), 1, f) != 1 || meta[1] >= ECMFILE_MAX_USER)
+			return -1;
+		if (meta[1] > 0 && fread(record->user, meta[1], 1, f) != 1)
+			return -1;
+
+		record->protocol = meta[0];
+		record->user[meta[1]] = '\0';
+		record->service_id = meta[2] | meta[3] << 8;
+		record->provider_id = meta[4] | meta[5] << 8 | meta[6] << 16 | (uint32_t) meta[7] << 24;
+	}
+
+	if (record->len > ECMFILE_MAX_ECM || fread(record->ecm, record->len, 1, f) != 1)
+		return -1;
+	if ((record->flags & ECMFILE_HAS_CW) && fread(record->cw, 32, 1, f) != 1)
+		return -1;
+	return 1;
+}
@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ECMFILE_H_
+#define ECMFILE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * File of ECM sections, used for synthetic test sets and captures of
+ * client requests. After an 8 byte magic every record holds a little
+ * endian 32 bit time in milliseconds, the 16 bit section length, a flags
+ * byte and a reserved byte. With ECMFILE_HAS_META the protocol, the length
+ * of the user name, the 16 bit service id, the 32 bit provider id and the
+ * user name follow. Then come the section and 32 control word bytes if
+ * ECMFILE_HAS_CW is set.
+ */
+#define ECMFILE_MAGIC "VMECM1\0\0"
+#define ECMFILE_MAX_ECM 512
+#define ECMFILE_MAX_USER 64
+#define ECMFILE_HAS_CW 0x01
+#define ECMFILE_HAS_META 0x02
+
+enum ecmfile_protocol {ECMFILE_NEWCAMD = 1, ECMFILE_CS378X};
+
+struct ecmfile_record {
+	uint32_t time_ms;
+	uint16_t len;
+	uint8_t flags;
+	uint8_t protocol;
+	uint16_t service_id;
+	uint32_t provider_id;
+	char user[ECMFILE_MAX_USER];
+	unsigned char ecm[ECMFILE_MAX_ECM];
+	unsigned char cw[32];
+};
+
+FILE * ecmfile_create(const char * path);
+FILE * ecmfile_open(const char * path);
+int ecmfile_write(FILE * f, const struct ecmfile_record * record);
+int ecmfile_read(FILE * f, struct ecmfile_record * record);
+
+#endif /* ECMFILE_H_ */
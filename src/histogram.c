@@ -0,0 +1,97 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "histogram.h"
+
+static unsigned int histogram_index(uint64_t value) {
+	unsigned int shift;
+
+	if (value < (2 << HISTOGRAM_SUB_BITS))
+		return value;
+
+	shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+	return (shift << HISTOGRAM_SUB_BITS) + (value >> shift);
+}
+
+// Middle of the range of values counted in bucket @index
+static uint64_t histogram_value(unsigned int index) {
+	unsigned int shift;
+
+	if (index < (2 << HISTOGRAM_SUB_BITS))
+		return index;
+
+	shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+	return ((uint64_t) (index - (shift << HISTOGRAM_SUB_BITS)) << shift) + ((1ULL << shift) >> 1);
+}
+
+void histogram_init(struct histogram * h) {
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void histogram_record(struct histogram * h, uint64_t value) {
+	h->counts[histogram_index(value)]++;
+	h->count++;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+void histogram_merge(struct histogram * dst, const struct histogram * src) {
+	unsigned int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+
+	dst->count += src->count;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/*
+ * Returns the value below which @percentile (0-100) of the recorded values
+ * fall, clamped to the exact minimum and maximum.
+ */
+uint64_t histogram_percentile(const struct histogram * h, double percentile) {
+	uint64_t rank, seen = 0, value;
+	unsigned int i;
+
+	if (h->count == 0)
+		return 0;
+
+	rank = (uint64_t) (percentile / 100 * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank)
+			break;
+	}
+
+	value = histogram_value(i);
+	if (value < h->min)
+		return h->min;
+	return value > h->max ? h->max : value;
+}
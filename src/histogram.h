@@ -0,0 +1,45 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram in the style of HdrHistogram: values below 64 are
+ * exact, above that every power of two is split in 32 buckets, so any
+ * recorded value is known within about 3%.
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_BUCKETS ((65 - HISTOGRAM_SUB_BITS) << HISTOGRAM_SUB_BITS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t counts[HISTOGRAM_BUCKETS];
+};
+
+void histogram_init(struct histogram * h);
+void histogram_record(struct histogram * h, uint64_t value);
+void histogram_merge(struct histogram * dst, const struct histogram * src);
+uint64_t histogram_percentile(const struct histogram * h, double percentile);
+
+#endif /* HISTOGRAM_H_ */
@@ -19,11 +19,16 @@
 
 #include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-
-#include <openssl/aes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "keyblock.h"
+#include "aesdec.h"
+#include "ecmcache.h"
+#include "crc32.h"
 #include "log.h"
 
 #define OFFSET_MKEY1 4
@@ -33,9 +38,51 @@
 
 #define OFFSET_CWKEYS 33
 
+#define KEYBLOCK_HDR_LEN 4
+#define KEYBLOCK_ENTRY_LEN 108
+#define KEYBLOCK_CHANNELS 65536
+#define KEYBLOCK_READER_SHARDS 16
+#define KEYBLOCK_BATCH_MAX 64
+#define ECM_BLOCKS 3
+
 #define touInt16(__data) (((&__data)[1] << 8) | __data)
 
-char * f_keyblock;
+/*
+ * Master keys are kept as expanded AES decrypt schedules and their expiry
+ * dates as time_t, so an ECM only costs a clock read and the AES itself.
+ */
+struct keyblock_entry {
+	uint16_t channel;
+	time_t expire[2];
+	struct aesdec_key mkey[2];
+};
+
+/*
+ * Immutable snapshot of a parsed keyblock. Once published it is never
+ * modified, a refresh builds a new snapshot and swaps the pointer.
+ */
+struct keyblock {
+	uint32_t count;
+	uint32_t index[KEYBLOCK_CHANNELS]; // Channel id -> entry + 1, 0 if unknown
+	struct keyblock_entry entries[];
+};
+
+/*
+ * Readers announce themselves in one of two counters selected by the
+ * current epoch. Counters are sharded over cache lines so concurrent ECM
+ * lookups don't bounce a single line between cores.
+ */
+struct reader_shard {
+	long count[2];
+} __attribute__((aligned(64)));
+
+static struct keyblock * current_keyblock = NULL;
+static unsigned int reader_epoch = 0;
+static struct reader_shard readers[KEYBLOCK_READER_SHARDS];
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread int reader_shard_id = -1;
+static unsigned int reader_shard_next = 0;
 
 time_t parse_ts(unsigned char * data) {
 	struct tm t;
@@ -52,80 +99,660 @@ time_t parse_ts(unsigned char * data) {
 	return t_of_day;
 }
 
-int32_t keyblock_analyse_file(unsigned char * dcw, unsigned char * ECM) {
-	FILE *fp;
-	unsigned char token[108];
-	unsigned char * mkey;
-	uint32_t t = 0;
-	AES_KEY aesmkey;
-	unsigned char table = ECM[0];
-	uint16_t channel = (ECM[18] << 8) + ECM[19];
-	time_t time_now, time_mkey1, time_mkey2;
-	char valid_till_str[64];
-	char valid_till_str2[64];
-	fp = fopen(f_keyblock, "r");
-	if (!fp) {
-		LOG(ERROR, "[KEYBLOCK] Could not open file %s", f_keyblock);
-		return (0);
-	}
-	LOG(INFO, "[KEYBLOCK] Find control word for Channel %d table 0x%02X", channel, table);
-
-	fseek(fp, 4, SEEK_SET);
-	while (fread(token, 108, 1, fp)) {
-		if ((uint16_t) ((token[t + 1] << 8) + token[t]) == channel) {
-			time_now = time(NULL);
-			time_mkey1 = parse_ts(token + OFFSET_EXPIRE_MKEY1);
-			time_mkey2 = parse_ts(token + OFFSET_EXPIRE_MKEY2);
-			LOG(DEBUG, "[KEYBLOCK] Master keys found for Channel: %d. Valid till: %s - %s",	channel, ctime_r(&time_mkey1, valid_till_str), ctime_r(&time_now, valid_till_str2));
-
-			if (difftime(time_mkey1, time_now) > 0) { // Check expire date mkey 1
-				LOG(DEBUG, "[KEYBLOCK] Master key 1 selected");
-				mkey = token + OFFSET_MKEY1;
-			} else {
-				if (difftime(time_mkey2, time_now) > 0) { // Check expire date mkey 2
-					LOG(DEBUG, "[KEYBLOCK] Master key 2 selected");
-					if (difftime(time_mkey2, time_now) < 86400) {
-						LOG(DEBUG, "[KEYBLOCK] Warning: Master keys for Channel: %d will expire in %d minutes",	channel, (int)difftime(time_mkey2, time_now) / 60);
-					}
-					mkey = token + OFFSET_MKEY2;
-				} else {
-					LOG(INFO, "[KEYBLOCK] Keyblock is to old\n");
-					return 0;
-				}
-			}
-			LOG(VERBOSE, "[KEYBLOCK] AES Key %2x %2x %2x %2x %2x %2x", mkey[0], mkey[1], mkey[2], mkey[3], mkey[4], mkey[5]);
-			AES_set_decrypt_key(mkey, 128, &aesmkey);
+static const struct keyblock * keyblock_acquire(int * ticket) {
+	if (reader_shard_id < 0)
+		reader_shard_id = __atomic_fetch_add(&reader_shard_next, 1, __ATOMIC_RELAXED) % KEYBLOCK_READER_SHARDS;
 
-			for (t = 0; t < 48; t += 16) {
-				AES_ecb_encrypt(&ECM[24 + t], &ECM[24 + t], &aesmkey,
-				AES_DECRYPT);
-				LOG(VERBOSE, "[KEYBLOCK] DEC %2x %2x %2x %2x %2x %2x %2x %2x %2x %2x %2x %2x %2x %2x %2x %2x", ECM[24 + t], ECM[24 + t +1], ECM[24 + t +2], ECM[24 + t +3], ECM[24 + t +4], ECM[24 + t +5], ECM[24 + t +6], ECM[24 + t +7], ECM[24 + t +8], ECM[24 + t +9], ECM[24 + t +10], ECM[24 + t +11], ECM[24 + t +12], ECM[24 + t +13], ECM[24 + t +14], ECM[24 + t +15]);
-			}
-			
-			LOG(VERBOSE, "[KEYBLOCK] ECM %2x %2x %2x %2x %2x %2x", ECM[0], ECM[1], ECM[2], ECM[3], ECM[4], ECM[5]);
-			LOG(VERBOSE, "[KEYBLOCK] Key 1 %2x %2x %2x %2x %2x %2x", ECM[0+OFFSET_CWKEYS], ECM[1+OFFSET_CWKEYS], ECM[2+OFFSET_CWKEYS], ECM[3+OFFSET_CWKEYS], ECM[4+OFFSET_CWKEYS], ECM[5+OFFSET_CWKEYS]);
-			LOG(VERBOSE, "[KEYBLOCK] Key 2 %2x %2x %2x %2x %2x %2x", ECM[0+OFFSET_CWKEYS+16], ECM[1+OFFSET_CWKEYS+16], ECM[2+OFFSET_CWKEYS+16], ECM[3+OFFSET_CWKEYS+16], ECM[4+OFFSET_CWKEYS+16], ECM[5+OFFSET_CWKEYS+16]);
-
-			
-			if (memcmp(&ECM[24], "CEB", 3) == 0) {
-				LOG(DEBUG, "[KEYBLOCK] ECM decrypt check passed");
-			} else {
-				LOG(VERBOSE, "[KEYBLOCK] Check %2x %2x %2x", ECM[24], ECM[25], ECM[26]);
-				LOG(ERROR, "[KEYBLOCK] ECM decrypt failed, wrong master key or unknown format");
-				//fclose(fp);
-				//return 0;
-			}
-			if (table == 0x80) {
-				memcpy(dcw, ECM + OFFSET_CWKEYS, 32);
-			} else {
-				memcpy(dcw, ECM + OFFSET_CWKEYS + 16, 16);
-				memcpy(dcw + 16, ECM + OFFSET_CWKEYS, 16);
-			}
+	*ticket = __atomic_load_n(&reader_epoch, __ATOMIC_SEQ_CST) & 1;
+	__atomic_fetch_add(&readers[reader_shard_id].count[*ticket], 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&current_keyblock, __ATOMIC_SEQ_CST);
+}
+
+static void keyblock_release(int ticket) {
+	__atomic_fetch_sub(&readers[reader_shard_id].count[ticket], 1, __ATOMIC_RELEASE);
+}
+
+static void keyblock_wait_readers(int ticket) {
+	long active;
+	int i;
+
+	do {
+		active = 0;
+		for (i = 0; i < KEYBLOCK_READER_SHARDS; i++)
+			active += __atomic_load_n(&readers[i].count[ticket], __ATOMIC_SEQ_CST);
+
+		if (active > 0)
+			usleep(1000);
+	} while (active > 0);
+}
+
+/*
+ * Make @kb the snapshot used for new lookups and free the previous one as
+ * soon as no reader can still be using it. The epoch is flipped twice so
+ * readers which sampled the epoch just before the swap are also waited for.
+ */
+static void keyblock_publish(struct keyblock * kb) {
+	struct keyblock * old;
+	unsigned int epoch;
+
+	pthread_mutex_lock(&publish_lock);
+	old = __atomic_exchange_n(&current_keyblock, kb, __ATOMIC_SEQ_CST);
+
+	epoch = __atomic_fetch_add(&reader_epoch, 1, __ATOMIC_SEQ_CST);
+	keyblock_wait_readers(epoch & 1);
+	epoch = __atomic_fetch_add(&reader_epoch, 1, __ATOMIC_SEQ_CST);
+	keyblock_wait_readers(epoch & 1);
+	pthread_mutex_unlock(&publish_lock);
+
+	ecm_cache_invalidate();
+	free(old);
+}
+
+static uint32_t get_le32(const unsigned char * p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void put_le32(unsigned char * p, uint32_t v) {
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+/*
+ * Snapshots are written to a temporary file with room for the header,
+ * which is filled in once the length and checksum are known. The file is
+ * synced and renamed over @path, so a crash leaves either the old or the
+ * new snapshot.
+ */
+static FILE * snapshot_create(const char * path, char * tmp, size_t tmp_len) {
+	unsigned char hdr[KEYBLOCK_SNAPSHOT_HDR_LEN] = {0};
+	FILE * fp;
+
+	snprintf(tmp, tmp_len, "%s.tmp", path);
+	if ((fp = fopen(tmp, "w+")) == NULL || fwrite(hdr, sizeof(hdr), 1, fp) != 1) {
+		LOG(ERROR, "[KEYBLOCK] Could not write keyblock to %s", tmp);
+		if (fp != NULL) {
 			fclose(fp);
-			return 1;
+			remove(tmp);
+		}
+		return NULL;
+	}
+	return fp;
+}
+
+static void snapshot_abort(FILE * fp, const char * tmp) {
+	fclose(fp);
+	remove(tmp);
+}
+
+// Leaves @tmp behind when it fails
+static int snapshot_commit(FILE * fp, const char * tmp, const char * path, size_t len, uint32_t crc, time_t fetched) {
+	unsigned char hdr[KEYBLOCK_SNAPSHOT_HDR_LEN];
+	char dir[4096];
+	const char * slash;
+	int fd;
+
+	memcpy(hdr, KEYBLOCK_SNAPSHOT_MAGIC, 8);
+	put_le32(hdr + 8, (uint64_t) fetched & 0xffffffff);
+	put_le32(hdr + 12, (uint64_t) fetched >> 32);
+	put_le32(hdr + 16, len);
+	put_le32(hdr + 20, crc);
+
+	if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(hdr, sizeof(hdr), 1, fp) != 1 || fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+		LOG(ERROR, "[KEYBLOCK] Could not write keyblock to %s", tmp);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	if (rename(tmp, path) != 0) {
+		LOG(ERROR, "[KEYBLOCK] Could not rename %s to %s", tmp, path);
+		return -1;
+	}
+
+	// Make the rename itself durable
+	slash = strrchr(path, '/');
+	snprintf(dir, sizeof(dir), "%.*s", slash != NULL ? (int) (slash - path) + 1 : 1, slash != NULL ? path : ".");
+	if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	return 0;
+}
+
+/*
+ * Reads the @len keyblock bytes of the temporary snapshot @tmp back and
+ * removes it. Returns NULL when not all of them made it to the file.
+ */
+static unsigned char * snapshot_read_back(const char * tmp, size_t len) {
+	unsigned char * data;
+	FILE * fp;
+
+	if ((data = malloc(len > 0 ? len : 1)) != NULL && (fp = fopen(tmp, "r")) != NULL) {
+		if (fseek(fp, KEYBLOCK_SNAPSHOT_HDR_LEN, SEEK_SET) != 0 || (len > 0 && fread(data, len, 1, fp) != 1)) {
+			free(data);
+			data = NULL;
+		}
+		fclose(fp);
+	} else {
+		free(data);
+		data = NULL;
+	}
+
+	remove(tmp);
+	return data;
+}
+
+// Snapshot of the published keyblock which couldn't be stored yet
+static struct {
+	char * path;
+	unsigned char * data;
+	size_t len;
+	time_t fetched;
+} snapshot_retry;
+
+static void snapshot_retry_clear(void) {
+	free(snapshot_retry.path);
+	free(snapshot_retry.data);
+	memset(&snapshot_retry, 0, sizeof(snapshot_retry));
+}
+
+/*
+ * Parses a keyblock while it arrives. Entries are indexed as soon as all
+ * their bytes were added, only a partial entry is held back, and the
+ * entries array grows as needed. Optionally the keyblock is written to a
+ * snapshot at the same time. Only when writing the snapshot fails the
+ * keyblock is kept in memory, so the snapshot can be retried later.
+ */
+struct keyblock_builder {
+	struct keyblock * kb;
+	uint32_t capacity;
+	size_t len;				// Bytes of the keyblock added
+	size_t fill;				// Bytes in entry
+	unsigned char entry[KEYBLOCK_ENTRY_LEN];
+	FILE * snapshot;
+	int keep;				// Snapshot failed, keep the keyblock in @raw
+	unsigned char * raw;
+	size_t raw_len, raw_size;
+	char * path;
+	char tmp[4096];
+	uint32_t crc;
+	time_t fetched;
+};
+
+struct keyblock_builder * keyblock_builder_new(const char * snapshot, time_t fetched) {
+	struct keyblock_builder * b;
+
+	if ((b = calloc(1, sizeof(*b))) == NULL || (b->kb = calloc(1, sizeof(struct keyblock))) == NULL) {
+		LOG(ERROR, "[KEYBLOCK] Not enough memory for keyblock");
+		free(b);
+		return NULL;
+	}
+
+	b->fetched = fetched;
+	if (snapshot != NULL && (b->path = strdup(snapshot)) == NULL) {
+		keyblock_builder_free(b);
+		return NULL;
+	}
+
+	if (b->path != NULL && (b->snapshot = snapshot_create(snapshot, b->tmp, sizeof(b->tmp))) == NULL)
+		b->keep = 1;
+	return b;
+}
+
+void keyblock_builder_free(struct keyblock_builder * b) {
+	if (b == NULL)
+		return;
+
+	if (b->snapshot != NULL)
+		snapshot_abort(b->snapshot, b->tmp);
+	free(b->raw);
+	free(b->path);
+	free(b->kb);
+	free(b);
+}
+
+static int keyblock_builder_entry(struct keyblock_builder * b, const unsigned char * token) {
+	struct keyblock * kb = b->kb;
+	struct keyblock_entry * entry;
+	uint16_t channel = (token[1] << 8) + token[0];
+
+	// First entry for a channel wins, just like the old linear scan
+	if (kb->index[channel] != 0)
+		return 0;
+
+	if (kb->count == b->capacity) {
+		b->capacity = b->capacity > 0 ? b->capacity * 2 : 256;
+		if ((kb = realloc(kb, sizeof(struct keyblock) + b->capacity * sizeof(struct keyblock_entry))) == NULL) {
+			LOG(ERROR, "[KEYBLOCK] Not enough memory for %u channels", b->capacity);
+			return -1;
+		}
+		b->kb = kb;
+	}
+
+	entry = &kb->entries[kb->count];
+	entry->channel = channel;
+	entry->expire[0] = parse_ts((unsigned char *) token + OFFSET_EXPIRE_MKEY1);
+	entry->expire[1] = parse_ts((unsigned char *) token + OFFSET_EXPIRE_MKEY2);
+	aesdec_set_key(&entry->mkey[0], token + OFFSET_MKEY1);
+	aesdec_set_key(&entry->mkey[1], token + OFFSET_MKEY2);
+	kb->count++;
+	kb->index[channel] = kb->count;
+	return 0;
+}
+
+/*
+ * Switches to keeping the keyblock in memory after its snapshot failed,
+ * starting with the bytes that made it to the temporary file.
+ */
+static void keyblock_builder_keep(struct keyblock_builder * b) {
+	b->keep = 1;
+	if ((b->raw = snapshot_read_back(b->tmp, b->len)) == NULL) {
+		LOG(ERROR, "[KEYBLOCK] Snapshot %s can't be retried, the next refresh stores it", b->path);
+		b->keep = 0;
+	}
+	b->raw_len = b->raw_size = b->len;
+}
+
+static void keyblock_builder_keep_add(struct keyblock_builder * b, const unsigned char * data, size_t len) {
+	unsigned char * raw;
+	size_t size = b->raw_size > 0 ? b->raw_size : 16384;
+
+	while (size < b->raw_len + len)
+		size *= 2;
+
+	if (size != b->raw_size) {
+		if ((raw = realloc(b->raw, size)) == NULL) {
+			LOG(ERROR, "[KEYBLOCK] Not enough memory to keep the keyblock for snapshot %s", b->path);
+			free(b->raw);
+			b->raw = NULL;
+			b->keep = 0;
+			return;
+		}
+		b->raw = raw;
+		b->raw_size = size;
+	}
+
+	memcpy(b->raw + b->raw_len, data, len);
+	b->raw_len += len;
+}
+
+// Adds the next @len bytes of the keyblock
+int keyblock_builder_add(struct keyblock_builder * b, const unsigned char * data, size_t len) {
+	size_t n;
+
+	// The keyblock is still loaded when its snapshot can't be written
+	if (b->snapshot != NULL && fwrite(data, len, 1, b->snapshot) != 1) {
+		LOG(ERROR, "[KEYBLOCK] Could not write keyblock to %s", b->tmp);
+		fclose(b->snapshot);
+		b->snapshot = NULL;
+		keyblock_builder_keep(b);
+	}
+	if (b->keep)
+		keyblock_builder_keep_add(b, data, len);
+	b->crc = crc32(b->crc, data, len);
+
+	// Skip the keyblock header
+	if (b->len < KEYBLOCK_HDR_LEN) {
+		n = KEYBLOCK_HDR_LEN - b->len < len ? KEYBLOCK_HDR_LEN - b->len : len;
+		b->len += n;
+		data += n;
+		len -= n;
+	}
+	b->len += len;
+
+	// Complete a partial entry first, then parse whole entries in place
+	if (b->fill > 0) {
+		n = KEYBLOCK_ENTRY_LEN - b->fill < len ? KEYBLOCK_ENTRY_LEN - b->fill : len;
+		memcpy(b->entry + b->fill, data, n);
+		b->fill += n;
+		data += n;
+		len -= n;
+		if (b->fill < KEYBLOCK_ENTRY_LEN)
+			return 0;
+		b->fill = 0;
+		if (keyblock_builder_entry(b, b->entry) < 0)
+			return -1;
+	}
+
+	for (; len >= KEYBLOCK_ENTRY_LEN; data += KEYBLOCK_ENTRY_LEN, len -= KEYBLOCK_ENTRY_LEN) {
+		if (keyblock_builder_entry(b, data) < 0)
+			return -1;
+	}
+
+	memcpy(b->entry, data, len);
+	b->fill = len;
+	return 0;
+}
+
+/*
+ * Publishes the keyblock and commits its snapshot, a trailing partial
+ * entry is ignored. A snapshot that couldn't be stored doesn't fail the
+ * publish, it's kept for keyblock_snapshot_retry(). Returns -1 when
+ * nothing was published. @b is freed in any case.
+ */
+int keyblock_builder_finish(struct keyblock_builder * b) {
+	struct keyblock * kb = b->kb;
+
+	if (kb->count == 0) {
+		LOG(ERROR, "[KEYBLOCK] Keyblock too short, %zu bytes", b->len);
+		keyblock_builder_free(b);
+		return -1;
+	}
+
+	// Give back what the last doubling of the entries didn't use
+	if (kb->count < b->capacity && (kb = realloc(kb, sizeof(struct keyblock) + kb->count * sizeof(struct keyblock_entry))) == NULL)
+		kb = b->kb;
+
+	if (b->snapshot != NULL && snapshot_commit(b->snapshot, b->tmp, b->path, b->len, b->crc, b->fetched) < 0)
+		keyblock_builder_keep(b);
+	b->snapshot = NULL;
+
+	b->kb = NULL;
+	keyblock_publish(kb);
+	LOG(INFO, "[KEYBLOCK] Loaded master keys for %u channels", kb->count);
+
+	// A newer keyblock replaces a snapshot still waiting for its retry
+	if (b->path != NULL) {
+		snapshot_retry_clear();
+		if (b->keep) {
+			LOG(ERROR, "[KEYBLOCK] Snapshot %s not stored, retrying later", b->path);
+			snapshot_retry.path = b->path;
+			snapshot_retry.data = b->raw;
+			snapshot_retry.len = b->raw_len;
+			snapshot_retry.fetched = b->fetched;
+			b->path = NULL;
+			b->raw = NULL;
 		}
 	}
-	LOG(ERROR, "[KEYBLOCK] No Master key found for channel: %d, cannot decrypt ECM", channel);
+
+	keyblock_builder_free(b);
+	return 0;
+}
+
+/*
+ * Retries storing the snapshot of the published keyblock after it
+ * failed, without fetching the keyblock again. Returns 1 while it's still
+ * not stored, otherwise 0.
+ */
+int keyblock_snapshot_retry(void) {
+	if (snapshot_retry.data == NULL)
+		return 0;
+
+	if (keyblock_save_file(snapshot_retry.path, snapshot_retry.data, snapshot_retry.len, snapshot_retry.fetched) < 0)
+		return 1;
+
+	LOG(INFO, "[KEYBLOCK] Stored snapshot %s", snapshot_retry.path);
+	snapshot_retry_clear();
+	return 0;
+}
+
+int keyblock_snapshot_pending(void) {
+	return snapshot_retry.data != NULL;
+}
+
+int keyblock_load(const unsigned char * data, size_t len) {
+	struct keyblock_builder * b;
+
+	if ((b = keyblock_builder_new(NULL, 0)) == NULL)
+		return -1;
+
+	if (keyblock_builder_add(b, data, len) < 0) {
+		keyblock_builder_free(b);
+		return -1;
+	}
+	return keyblock_builder_finish(b);
+}
+
+/*
+ * Loads a keyblock snapshot and sets @fetched to the time it was fetched.
+ * A snapshot with a bad length or checksum is not loaded. Plain keyblock
+ * files are still loaded, but with @fetched 0 as they can't be validated.
+ * The file is parsed while it's read, without holding all of it.
+ */
+int keyblock_load_file(const char * path, time_t * fetched) {
+	FILE * fp;
+	struct keyblock_builder * b;
+	unsigned char hdr[KEYBLOCK_SNAPSHOT_HDR_LEN], buf[16384];
+	size_t n, hdr_len;
+	long len;
+	uint32_t kb_len, crc = 0;
+	int snapshot, ret = -1;
+
+	*fetched = 0;
+	fp = fopen(path, "r");
+	if (!fp) {
+		LOG(ERROR, "[KEYBLOCK] Could not open file %s", path);
+		return -1;
+	}
+
+	if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) <= 0 || fseek(fp, 0, SEEK_SET) != 0) {
+		LOG(ERROR, "[KEYBLOCK] Keyblock file %s is empty", path);
+		fclose(fp);
+		return -1;
+	}
+
+	if ((b = keyblock_builder_new(NULL, 0)) == NULL) {
+		fclose(fp);
+		return -1;
+	}
+
+	hdr_len = fread(hdr, 1, sizeof(hdr), fp);
+	snapshot = hdr_len == sizeof(hdr) && memcmp(hdr, KEYBLOCK_SNAPSHOT_MAGIC, 8) == 0;
+	if (!snapshot) {
+		LOG(INFO, "[KEYBLOCK] %s is no snapshot, loading it unvalidated", path);
+		if (keyblock_builder_add(b, hdr, hdr_len) < 0)
+			goto cleanup;
+	} else if ((kb_len = get_le32(hdr + 16)) != len - KEYBLOCK_SNAPSHOT_HDR_LEN) {
+		LOG(ERROR, "[KEYBLOCK] Snapshot %s is corrupt", path);
+		goto cleanup;
+	}
+
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		crc = crc32(crc, buf, n);
+		if (keyblock_builder_add(b, buf, n) < 0)
+			goto cleanup;
+	}
+
+	if (ferror(fp)) {
+		LOG(ERROR, "[KEYBLOCK] Could not read file %s", path);
+		goto cleanup;
+	}
+
+	if (snapshot && crc != get_le32(hdr + 20)) {
+		LOG(ERROR, "[KEYBLOCK] Snapshot %s is corrupt", path);
+		goto cleanup;
+	}
+
+	ret = keyblock_builder_finish(b);
+	b = NULL;
+	if (ret == 0 && snapshot)
+		*fetched = get_le32(hdr + 8) | (uint64_t) get_le32(hdr + 12) << 32;
+
+cleanup:
+	keyblock_builder_free(b);
 	fclose(fp);
+	return ret;
+}
+
+// Stores @data as snapshot at @path
+int keyblock_save_file(const char * path, const unsigned char * data, size_t len, time_t fetched) {
+	char tmp[4096];
+	FILE * fp;
+
+	if ((fp = snapshot_create(path, tmp, sizeof(tmp))) == NULL)
+		return -1;
+
+	if (fwrite(data, len, 1, fp) != 1) {
+		LOG(ERROR, "[KEYBLOCK] Could not write keyblock to %s", tmp);
+		snapshot_abort(fp, tmp);
+		return -1;
+	}
+
+	if (snapshot_commit(fp, tmp, path, len, crc32(0L, data, len), fetched) < 0) {
+		remove(tmp);
+		return -1;
+	}
 	return 0;
 }
+
+/*
+ * Returns the first time after @now a master key of any channel expires,
+ * or 0 when no keyblock is loaded or all keys already expired. Rollovers
+ * up to @covered are skipped when the channel's other key stays valid
+ * past them, the loaded keyblock already has their successor then.
+ */
+time_t keyblock_next_rollover(time_t now, time_t covered) {
+	const struct keyblock * kb;
+	const time_t * expire;
+	time_t next = 0;
+	uint32_t i;
+	int ticket, j;
+
+	kb = keyblock_acquire(&ticket);
+	for (i = 0; kb != NULL && i < kb->count; i++) {
+		expire = kb->entries[i].expire;
+		for (j = 0; j < 2; j++) {
+			if (expire[j] <= covered && expire[1 - j] > expire[j])
+				continue;
+			if (expire[j] > now && (next == 0 || expire[j] < next))
+				next = expire[j];
+		}
+	}
+	keyblock_release(ticket);
+	return next;
+}
+
+static time_t coarse_time(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+static const struct aesdec_key * keyblock_select_key(const struct keyblock_entry * entry, time_t time_now) {
+	uint16_t channel = entry->channel;
+	char valid_till_str[64];
+	char valid_till_str2[64];
+
+	LOG(DEBUG, "[KEYBLOCK] Master keys found for Channel: %d. Valid till: %s - %s",	channel, ctime_r(&entry->expire[0], valid_till_str), ctime_r(&time_now, valid_till_str2));
+
+	if (entry->expire[0] > time_now) { // Check expire date mkey 1
+		LOG(DEBUG, "[KEYBLOCK] Master key 1 selected");
+		return &entry->mkey[0];
+	} else if (entry->expire[1] > time_now) { // Check expire date mkey 2
+		LOG(DEBUG, "[KEYBLOCK] Master key 2 selected");
+		if (entry->expire[1] - time_now < 86400) {
+			LOG(DEBUG, "[KEYBLOCK] Warning: Master keys for Channel: %d will expire in %d minutes",	channel, (int)(entry->expire[1] - time_now) / 60);
+		}
+		return &entry->mkey[1];
+	}
+
+	LOG(INFO, "[KEYBLOCK] Keyblock is to old");
+	return NULL;
+}
+
+static void keyblock_extract_cw(unsigned char * dcw, unsigned char * ECM) {
+	unsigned char table = ECM[0];
+
+	LOG_HEX(VERBOSE, "[KEYBLOCK] DEC", ECM + 24, 48);
+	LOG_HEX(VERBOSE, "[KEYBLOCK] ECM", ECM, 6);
+	LOG_HEX(VERBOSE, "[KEYBLOCK] Key 1", ECM + OFFSET_CWKEYS, 6);
+	LOG_HEX(VERBOSE, "[KEYBLOCK] Key 2", ECM + OFFSET_CWKEYS + 16, 6);
+
+	if (memcmp(&ECM[24], "CEB", 3) == 0) {
+		LOG(DEBUG, "[KEYBLOCK] ECM decrypt check passed");
+	} else {
+		LOG_HEX(VERBOSE, "[KEYBLOCK] Check", ECM + 24, 3);
+		LOG(ERROR, "[KEYBLOCK] ECM decrypt failed, wrong master key or unknown format");
+	}
+	if (table == 0x80) {
+		memcpy(dcw, ECM + OFFSET_CWKEYS, 32);
+	} else {
+		memcpy(dcw, ECM + OFFSET_CWKEYS + 16, 16);
+		memcpy(dcw + 16, ECM + OFFSET_CWKEYS, 16);
+	}
+}
+
+/*
+ * Decrypts up to KEYBLOCK_BATCH_MAX ECMs against one snapshot. The AES
+ * blocks of all ECMs are collected first and handed to the AES kernel in
+ * one call, so independent blocks can be interleaved even when every ECM
+ * uses a different master key.
+ */
+static void keyblock_analyse_chunk(struct keyblock_ecm * ecms, size_t n) {
+	const struct keyblock * kb;
+	const struct aesdec_key * keys[KEYBLOCK_BATCH_MAX * ECM_BLOCKS];
+	unsigned char * blocks[KEYBLOCK_BATCH_MAX * ECM_BLOCKS];
+	struct ecm_cache_key cache_keys[KEYBLOCK_BATCH_MAX];
+	time_t valid[KEYBLOCK_BATCH_MAX];
+	const struct keyblock_entry * entry;
+	const struct aesdec_key * mkey;
+	unsigned char * ECM;
+	size_t i, nblocks = 0;
+	uint32_t pos, t;
+	uint16_t channel;
+	time_t time_now = coarse_time();
+	int ticket;
+
+	kb = keyblock_acquire(&ticket);
+	for (i = 0; i < n; i++) {
+		ECM = ecms[i].ecm;
+		channel = (ECM[18] << 8) + ECM[19];
+		ecms[i].result = 0;
+
+		LOG(INFO, "[KEYBLOCK] Find control word for Channel %d table 0x%02X", channel, ECM[0]);
+
+		// Taken while holding kb, a publish only invalidates the cache after kb was released
+		ecm_cache_key(&cache_keys[i], ECM);
+		if (ecm_cache_get(&cache_keys[i], ecms[i].dcw)) {
+			LOG(DEBUG, "[KEYBLOCK] Control word for Channel %d found in cache", channel);
+			ecms[i].result = 1;
+			continue;
+		}
+
+		if (kb == NULL) {
+			LOG(ERROR, "[KEYBLOCK] No keyblock loaded, cannot decrypt ECM");
+		} else if ((pos = kb->index[channel]) == 0) {
+			LOG(ERROR, "[KEYBLOCK] No Master key found for channel: %d, cannot decrypt ECM", channel);
+		} else if ((mkey = keyblock_select_key(entry = &kb->entries[pos - 1], time_now)) != NULL) {
+			valid[i] = entry->expire[mkey == &entry->mkey[0] ? 0 : 1];
+			for (t = 0; t < ECM_BLOCKS; t++) {
+				keys[nblocks] = mkey;
+				blocks[nblocks] = ECM + 24 + t * 16;
+				nblocks++;
+			}
+			ecms[i].result = -1; // Pending decryption
+		}
+	}
+
+	aesdec_blocks(keys, blocks, nblocks);
+	keyblock_release(ticket);
+
+	for (i = 0; i < n; i++) {
+		if (ecms[i].result != -1)
+			continue;
+
+		keyblock_extract_cw(ecms[i].dcw, ecms[i].ecm);
+		ecm_cache_put(&cache_keys[i], ecms[i].dcw, valid[i]);
+		ecms[i].result = 1;
+	}
+}
+
+void keyblock_analyse_batch(struct keyblock_ecm * ecms, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i += KEYBLOCK_BATCH_MAX)
+		keyblock_analyse_chunk(ecms + i, n - i < KEYBLOCK_BATCH_MAX ? n - i : KEYBLOCK_BATCH_MAX);
+}
+
+int32_t keyblock_analyse(unsigned char * dcw, unsigned char * ECM) {
+	struct keyblock_ecm ecm;
+
+	ecm.ecm = ECM;
+	ecm.dcw = dcw;
+	keyblock_analyse_chunk(&ecm, 1);
+
+	return ecm.result;
+}
@@ -17,6 +17,45 @@
  * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef KEYBLOCK_H_
+#define KEYBLOCK_H_
+
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Snapshot of a fetched keyblock in the cache directory: an 8 byte magic,
+ * the 64 bit fetch time and the 32 bit keyblock length and CRC32, all
+ * little endian, followed by the keyblock as VKS sent it.
+ */
+#define KEYBLOCK_SNAPSHOT_MAGIC "VMKB\x01\0\0\0"
+#define KEYBLOCK_SNAPSHOT_HDR_LEN 24
+
+struct keyblock_builder;
+
+struct keyblock_builder * keyblock_builder_new(const char * snapshot, time_t fetched);
+int keyblock_builder_add(struct keyblock_builder * b, const unsigned char * data, size_t len);
+int keyblock_builder_finish(struct keyblock_builder * b);
+void keyblock_builder_free(struct keyblock_builder * b);
+int keyblock_snapshot_retry(void);
+int keyblock_snapshot_pending(void);
+
+int keyblock_load(const unsigned char * data, size_t len);
+int keyblock_load_file(const char * path, time_t * fetched);
+int keyblock_save_file(const char * path, const unsigned char * data, size_t len, time_t fetched);
+time_t keyblock_next_rollover(time_t now, time_t covered);
+
+// Bytes of an ECM section the analysis reads and decrypts
+#define KEYBLOCK_ECM_LEN 72
+
+struct keyblock_ecm {
+	unsigned char * ecm;	// ECM section, decrypted in place
+	unsigned char * dcw;	// 32 bytes for the resulting control words
+	int32_t result;		// 1 when the control words were found
+};
+
+int32_t keyblock_analyse(unsigned char * dcw, unsigned char * ECM);
+void keyblock_analyse_batch(struct keyblock_ecm * ecms, size_t n);
 
-int32_t keyblock_analyse_file(unsigned char * dcw, unsigned char * ECM);
\ No newline at end of file
+#endif /* KEYBLOCK_H_ */
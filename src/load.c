@@ -0,0 +1,811 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "account.h"
+#include "keyblock.h"
+#include "newcamd.h"
+#include "cs378x.h"
+#include "histogram.h"
+#include "synth.h"
+#include "ecmfile.h"
+#include "log.h"
+
+#define LOAD_ECMS_PER_CHANNEL 4
+#define LOAD_MAX_DEPTH 64
+#define LOAD_BUF_LEN 4096
+#define LOAD_FRAME_ROOM 512	// Space an encoder needs in the output buffer
+#define LOAD_NEWCAMD_MAX_ECM 376	// Newcamd message minus header and padding
+#define LOAD_CS378X_MAX_ECM 255	// Single length byte in the CS378x header
+
+enum load_protocol {LOAD_NEWCAMD, LOAD_CS378X};
+
+struct load_ecm {
+	unsigned char * ecm;
+	uint16_t len;
+	uint16_t channel;
+	uint32_t provider_id;
+	uint32_t time_ms;	// Offset in a replayed capture
+	unsigned int conn;	// Connection a replayed request is sent on
+	int has_cw;
+	unsigned char cw[32];
+};
+
+struct load_pending {
+	uint64_t intended;	// Scheduled send time, latency is measured from here
+	uint32_t ecm;
+	uint16_t msg_id;
+};
+
+struct load_conn {
+	int fd;
+	unsigned int channel;
+	unsigned int seq;
+	uint16_t msg_id;
+	union {
+		struct newcamd newcamd;
+		struct cs378x cs378x;
+	} proto;
+	struct load_pending pending[LOAD_MAX_DEPTH];
+	unsigned int head, tail;
+	struct sendbuf out;
+	int have;
+	unsigned char in[LOAD_BUF_LEN];
+	unsigned char outbuf[LOAD_BUF_LEN];
+};
+
+struct load_stats {
+	uint64_t sent;
+	uint64_t ok;
+	uint64_t wrong;		// Replies with other control words than expected
+	uint64_t empty;		// Replies without control words to captured requests
+	uint64_t timeouts;
+	uint64_t conn_errors;
+	uint64_t login_errors;
+	uint64_t zaps;
+	struct histogram latency;
+};
+
+struct load_thread {
+	pthread_t thread;
+	unsigned int index;
+	unsigned int next_record;	// Next captured request to replay
+	struct load_conn * conns;
+	unsigned int count;
+	int epfd;
+	int timerfd;		// Wakes the thread when the next request is due
+	int blocked;		// Some connection has unsent output
+	uint64_t rng;
+	struct load_stats stats;
+};
+
+static enum load_protocol protocol = LOAD_NEWCAMD;
+static int port = 0;
+static const struct account * account;
+static unsigned int connections = 100;
+static unsigned int threads = 1;
+static double rate = 1000;
+static double duration = 10;
+static unsigned int depth = 8;
+static unsigned int timeout_ms = 2000;
+static double zipf = 0;
+static unsigned int zap_interval_ms = 0;
+static double zap_fraction = 0.1;
+static const char * replay;
+static double speed = 1;
+
+static struct load_ecm * ecms;
+static unsigned int records;	// Captured requests in ecms when replaying
+static unsigned int channels;
+static double * popularity;	// Cumulative distribution over the channels
+static uint64_t start_ns;
+static pthread_barrier_t started;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Builds LOAD_ECMS_PER_CHANNEL ECMs with random control words for the first
+ * @limit channels of the keyblock vmcam serves.
+ */
+static int load_ecms(const char * path, unsigned int limit) {
+	unsigned char * keyblock, mkey[16];
+	uint64_t rng = 0x766d63616d;
+	unsigned int i, j, k;
+	long len;
+	FILE * f;
+
+	if ((f = fopen(path, "rb")) == NULL || fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < 4 + 108) {
+		fprintf(stderr, "Can't read keyblock %s\n", path);
+		return -1;
+	}
+
+	rewind(f);
+	if ((keyblock = malloc(len)) == NULL || fread(keyblock, len, 1, f) != 1) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	// Snapshots written by vmcam carry a header before the keyblock
+	if (len > KEYBLOCK_SNAPSHOT_HDR_LEN && memcmp(keyblock, KEYBLOCK_SNAPSHOT_MAGIC, 8) == 0) {
+		len -= KEYBLOCK_SNAPSHOT_HDR_LEN;
+		memmove(keyblock, keyblock + KEYBLOCK_SNAPSHOT_HDR_LEN, len);
+	}
+
+	if ((channels = (len - 4) / 108) == 0) {
+		fprintf(stderr, "Can't read keyblock %s\n", path);
+		return -1;
+	}
+	if (limit > 0 && limit < channels)
+		channels = limit;
+
+	if ((ecms = malloc(channels * LOAD_ECMS_PER_CHANNEL * sizeof(struct load_ecm))) == NULL || (popularity = malloc(channels * sizeof(double))) == NULL ||
+			(ecms[0].ecm = malloc(channels * LOAD_ECMS_PER_CHANNEL * SYNTH_ECM_LEN)) == NULL)
+		return -1;
+
+	for (i = 0; i < channels; i++) {
+		for (j = 0; j < LOAD_ECMS_PER_CHANNEL; j++) {
+			struct load_ecm * e = &ecms[i * LOAD_ECMS_PER_CHANNEL + j];
+
+			e->ecm = ecms[0].ecm + (i * LOAD_ECMS_PER_CHANNEL + j) * SYNTH_ECM_LEN;
+			e->len = SYNTH_ECM_LEN;
+			e->provider_id = 0;
+			e->has_cw = 1;
+			synth_keyblock_mkey(keyblock, i, time(NULL), &e->channel, mkey);
+			for (k = 0; k < 32; k++)
+				e->cw[k] = synth_rand(&rng);
+			synth_ecm(e->ecm, mkey, e->channel, 0x80 | (j & 1), e->cw);
+		}
+
+		// Zipf distributed channel popularity, uniform with an exponent of 0
+		popularity[i] = (i > 0 ? popularity[i - 1] : 0) + 1 / pow(i + 1, zipf);
+	}
+	for (i = 0; i < channels; i++)
+		popularity[i] /= popularity[channels - 1];
+
+	free(keyblock);
+	return 0;
+}
+
+/*
+ * Reads a capture or synthetic ECM file. Requests of one user and channel
+ * share a connection, so their order is kept when replaying.
+ */
+static int load_capture(const char * path) {
+	struct ecmfile_record record;
+	struct load_ecm * e;
+	unsigned int size = 0, skipped = 0, max_len, i;
+	uint32_t hash, base = 0;
+	FILE * f;
+	int ret;
+
+	if ((f = ecmfile_open(path)) == NULL)
+		return -1;
+
+	max_len = protocol == LOAD_NEWCAMD ? LOAD_NEWCAMD_MAX_ECM : LOAD_CS378X_MAX_ECM;
+	while ((ret = ecmfile_read(f, &record)) > 0) {
+		if (record.len < 3 || record.len > max_len) {
+			skipped++;
+			continue;
+		}
+
+		if (records == size) {
+			size = size > 0 ? size * 2 : 1024;
+			if ((ecms = realloc(ecms, size * sizeof(struct load_ecm))) == NULL)
+				return -1;
+		}
+
+		e = &ecms[records++];
+		if ((e->ecm = malloc(record.len)) == NULL)
+			return -1;
+		memcpy(e->ecm, record.ecm, record.len);
+		e->len = record.len;
+		e->channel = record.service_id;
+		e->provider_id = record.provider_id;
+		if (records == 1)
+			base = record.time_ms;
+		e->time_ms = record.time_ms > base ? record.time_ms - base : 0;
+		e->has_cw = (record.flags & ECMFILE_HAS_CW) != 0;
+		memcpy(e->cw, record.cw, sizeof(e->cw));
+
+		// FNV-1a over user and service id
+		hash = 2166136261u;
+		for (i = 0; record.user[i] != '\0'; i++)
+			hash = (hash ^ (unsigned char) record.user[i]) * 16777619u;
+		hash = ((hash ^ (record.service_id >> 8)) * 16777619u ^ (record.service_id & 0xff)) * 16777619u;
+		e->conn = hash % connections;
+	}
+	fclose(f);
+
+	// A capture of a killed vmcam may end in a partial record
+	if (ret < 0 && records > 0)
+		fprintf(stderr, "Ignoring truncated record at the end of %s\n", path);
+	if (records == 0) {
+		fprintf(stderr, "No requests to replay in %s\n", path);
+		return -1;
+	}
+	if (skipped > 0)
+		fprintf(stderr, "Skipped %u requests too long for %s\n", skipped, protocol == LOAD_NEWCAMD ? "newcamd" : "cs378x");
+
+	return 0;
+}
+
+static unsigned int pick_channel(uint64_t * rng) {
+	double r = synth_rand(rng) / 4294967296.0;
+	unsigned int low = 0, high = channels - 1, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (popularity[mid] > r)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return low;
+}
+
+static int load_connect(struct load_conn * c) {
+	struct sockaddr_in addr;
+	int one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		return -1;
+
+	c->out.data = c->outbuf;
+	c->out.size = sizeof(c->outbuf);
+	if (protocol == LOAD_NEWCAMD) {
+		c->proto.newcamd.client_fd = c->fd;
+		if (newcamd_login(&c->proto.newcamd, account) < 0)
+			return -2;
+		c->proto.newcamd.out = &c->out;
+	} else {
+		cs378x_init(&c->proto.cs378x);
+		c->proto.cs378x.client_fd = c->fd;
+		c->proto.cs378x.account = account;
+		c->proto.cs378x.out = &c->out;
+	}
+
+	return fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Requests still outstanding on the connection are counted as timed out
+static void load_close(struct load_thread * t, struct load_conn * c, int error) {
+	if (c->fd < 0)
+		return;
+
+	if (error)
+		t->stats.conn_errors++;
+	t->stats.timeouts += c->head - c->tail;
+	c->tail = c->head;
+	close(c->fd);
+	c->fd = -1;
+}
+
+static int load_flush(struct load_thread * t, struct load_conn * c) {
+	int n;
+
+	while (c->out.len > 0) {
+		if ((n = write(c->fd, c->outbuf, c->out.len)) < 0) {
+			if (errno == EAGAIN) {
+				t->blocked = 1;
+				return 0;
+			}
+			load_close(t, c, 1);
+			return -1;
+		}
+		c->out.len -= n;
+		memmove(c->outbuf, c->outbuf + n, c->out.len);
+	}
+	return 0;
+}
+
+static int load_can_send(const struct load_conn * c) {
+	return c->fd >= 0 && c->head - c->tail < depth && c->out.size - c->out.len >= LOAD_FRAME_ROOM;
+}
+
+static void load_send(struct load_thread * t, struct load_conn * c, unsigned int ecm, uint64_t intended) {
+	struct load_pending * p = &c->pending[c->head++ % LOAD_MAX_DEPTH];
+	unsigned char data[CAMD35_HDR_LEN + LOAD_NEWCAMD_MAX_ECM];
+	const struct load_ecm * e = &ecms[ecm];
+
+	p->ecm = ecm;
+	p->msg_id = c->msg_id++;
+	p->intended = intended;
+
+	if (protocol == LOAD_NEWCAMD) {
+		memcpy(data, e->ecm, e->len);
+		newcamd_send(&c->proto.newcamd, data, e->len, e->channel, p->msg_id, e->provider_id);
+	} else {
+		memset(data, 0, CAMD35_HDR_LEN);
+		data[8] = e->channel >> 8;
+		data[9] = e->channel & 0xff;
+		data[12] = e->provider_id >> 24;
+		data[13] = (e->provider_id >> 16) & 0xff;
+		data[14] = (e->provider_id >> 8) & 0xff;
+		data[15] = e->provider_id & 0xff;
+		data[16] = p->msg_id >> 8;
+		data[17] = p->msg_id & 0xff;
+		memcpy(data + CAMD35_HDR_LEN, e->ecm, e->len);
+		cs378x_send(&c->proto.cs378x, data, e->len);
+	}
+	t->stats.sent++;
+	load_flush(t, c);
+}
+
+static void load_next(struct load_thread * t, struct load_conn * c, uint64_t intended) {
+	load_send(t, c, c->channel * LOAD_ECMS_PER_CHANNEL + c->seq++ % LOAD_ECMS_PER_CHANNEL, intended);
+}
+
+/*
+ * Captures without control words are answered by a keyblock the replaying
+ * side doesn't know, so any reply to them counts.
+ */
+static void load_reply(struct load_thread * t, struct load_conn * c, const unsigned char * cw, uint16_t msg_id) {
+	struct load_pending * p;
+	const struct load_ecm * e;
+
+	if (c->head == c->tail) {
+		t->stats.wrong++;
+		return;
+	}
+
+	p = &c->pending[c->tail++ % LOAD_MAX_DEPTH];
+	e = &ecms[p->ecm];
+	if (p->msg_id != msg_id || (e->has_cw && (cw == NULL || memcmp(cw, e->cw, 32) != 0))) {
+		t->stats.wrong++;
+		return;
+	}
+
+	if (cw == NULL)
+		t->stats.empty++;
+	else
+		t->stats.ok++;
+	histogram_record(&t->stats.latency, now_ns() - p->intended);
+}
+
+static void load_receive(struct load_thread * t, struct load_conn * c) {
+	unsigned char data[LOAD_BUF_LEN];
+	uint16_t service_id, msg_id;
+	uint32_t provider_id;
+	int n, off = 0, len;
+
+	if ((n = read(c->fd, c->in + c->have, sizeof(c->in) - c->have)) <= 0) {
+		if (n < 0 && errno == EAGAIN)
+			return;
+		load_close(t, c, 1);
+		return;
+	}
+	c->have += n;
+
+	while (c->fd >= 0) {
+		if (protocol == LOAD_NEWCAMD)
+			len = newcamd_frame_len(c->in + off, c->have - off);
+		else
+			len = cs378x_frame_len(&c->proto.cs378x, c->in + off, c->have - off);
+
+		if (len < 0 || len > (int) sizeof(c->in)) {
+			load_close(t, c, 1);
+			return;
+		}
+		if (c->have - off < len)
+			break;
+
+		if (protocol == LOAD_NEWCAMD) {
+			if ((n = newcamd_decode(&c->proto.newcamd, c->in + off + 2, len - 2, data, &service_id, &msg_id, &provider_id)) < 0) {
+				load_close(t, c, 1);
+				return;
+			}
+			load_reply(t, c, n >= 35 ? data + 3 : NULL, msg_id);
+		} else {
+			if ((n = cs378x_decode(&c->proto.cs378x, c->in + off, len, data)) < CAMD35_HDR_LEN) {
+				load_close(t, c, 1);
+				return;
+			}
+			load_reply(t, c, n >= CAMD35_HDR_LEN + 32 && data[0] == 0x01 ? data + CAMD35_HDR_LEN : NULL, (data[16] << 8) | data[17]);
+		}
+		off += len;
+	}
+
+	c->have -= off;
+	memmove(c->in, c->in + off, c->have);
+}
+
+/*
+ * Drops connections whose oldest request is unanswered for longer than
+ * the timeout, their outstanding requests count as timed out.
+ */
+static void load_check_timeouts(struct load_thread * t, uint64_t now) {
+	struct load_conn * c;
+	unsigned int i;
+
+	for (i = 0; i < t->count; i++) {
+		c = &t->conns[i];
+		if (c->fd >= 0 && c->head != c->tail && now - c->pending[c->tail % LOAD_MAX_DEPTH].intended > timeout_ms * 1000000ULL)
+			load_close(t, c, 0);
+	}
+}
+
+static unsigned int load_in_flight(const struct load_thread * t) {
+	unsigned int i, n = 0;
+
+	for (i = 0; i < t->count; i++) {
+		if (t->conns[i].fd >= 0)
+			n += t->conns[i].head - t->conns[i].tail;
+	}
+	return n;
+}
+
+// Skips captured requests replayed by other threads, NULL when done
+static const struct load_ecm * load_replay_next(struct load_thread * t) {
+	while (t->next_record < records && ecms[t->next_record].conn % threads != t->index)
+		t->next_record++;
+
+	return t->next_record < records ? &ecms[t->next_record] : NULL;
+}
+
+static uint64_t load_replay_time(const struct load_ecm * e) {
+	return speed > 0 ? start_ns + (uint64_t) (e->time_ms * 1e6 / speed) : start_ns;
+}
+
+/*
+ * Sends the captured requests that are due in order. A request waits for
+ * its own connection, holding back the ones after it like a real client.
+ */
+static void load_replay(struct load_thread * t, uint64_t now) {
+	const struct load_ecm * e;
+	struct load_conn * c;
+	uint64_t intended;
+
+	while ((e = load_replay_next(t)) != NULL && (intended = load_replay_time(e)) <= now) {
+		c = &t->conns[e->conn / threads];
+		if (c->fd < 0) {
+			t->stats.sent++;
+			t->stats.timeouts++;
+		} else if (load_can_send(c)) {
+			load_send(t, c, t->next_record, speed > 0 ? intended : now);
+		} else {
+			break;
+		}
+		t->next_record++;
+	}
+}
+
+/*
+ * Issues requests at a fixed rate round robin over the connections of the
+ * thread, or replays a capture. Requests that can't be sent because the
+ * connections are busy keep their scheduled time, so a slow server shows
+ * up in the latency.
+ */
+static void *load_thread_run(void * arg) {
+	struct load_thread * t = arg;
+	struct epoll_event events[256];
+	struct epoll_event ev;
+	struct itimerspec timer;
+	struct load_conn * c;
+	uint64_t now, issued = 0, interval, end, drain = 0, next_zap, next_check, wake, expirations;
+	const struct load_ecm * e;
+	unsigned int i, next = 0, tries;
+	int n, ret;
+
+	for (i = 0; i < t->count; i++) {
+		c = &t->conns[i];
+		if (replay == NULL)
+			c->channel = pick_channel(&t->rng);
+		if ((ret = load_connect(c)) < 0) {
+			if (ret == -2)
+				t->stats.login_errors++;
+			else
+				t->stats.conn_errors++;
+			if (c->fd >= 0)
+				close(c->fd);
+			c->fd = -1;
+			continue;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	}
+
+	memset(&timer, 0, sizeof(timer));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->timerfd, &ev);
+
+	// Wait for all threads to connect, then main sets the start time
+	pthread_barrier_wait(&started);
+	pthread_barrier_wait(&started);
+
+	interval = 1e9 * threads / rate;
+	now = now_ns();
+
+	end = start_ns + duration * 1e9;
+	next_zap = start_ns + zap_interval_ms * 1000000ULL;
+	next_check = now;
+	for (;;) {
+		if (replay != NULL)
+			load_replay(t, now);
+
+		while (replay == NULL && now < end && start_ns + issued * interval <= now) {
+			for (tries = 0; tries < t->count && !load_can_send(&t->conns[next]); tries++)
+				next = (next + 1) % t->count;
+			if (tries == t->count)
+				break;
+
+			load_next(t, &t->conns[next], start_ns + issued * interval);
+			next = (next + 1) % t->count;
+			issued++;
+		}
+
+		// Zapping: a share of the viewers switches channel at once
+		if (zap_interval_ms > 0 && now < end && now >= next_zap) {
+			for (i = 0; i < t->count; i++) {
+				c = &t->conns[i];
+				if (synth_rand(&t->rng) / 4294967296.0 < zap_fraction && load_can_send(c)) {
+					c->channel = pick_channel(&t->rng);
+					load_next(t, c, now);
+					t->stats.zaps++;
+				}
+			}
+			next_zap += zap_interval_ms * 1000000ULL;
+		}
+
+		if (t->blocked) {
+			t->blocked = 0;
+			for (i = 0; i < t->count; i++) {
+				if (t->conns[i].out.len > 0 && t->conns[i].fd >= 0)
+					load_flush(t, &t->conns[i]);
+			}
+		}
+
+		if (now >= next_check) {
+			load_check_timeouts(t, now);
+			next_check = now + 100000000ULL;
+		}
+
+		// Once all requests are out wait for their replies until the timeout
+		e = replay != NULL ? load_replay_next(t) : NULL;
+		if (replay != NULL ? e == NULL : now >= end) {
+			if (drain == 0)
+				drain = now + timeout_ms * 1000000ULL;
+			if (load_in_flight(t) == 0 || now >= drain)
+				break;
+			wake = drain;
+		} else {
+			wake = replay != NULL ? load_replay_time(e) : start_ns + issued * interval;
+		}
+
+		// A request held back by busy connections is sent on their replies
+		if (wake <= now || next_check < wake)
+			wake = next_check;
+		if (zap_interval_ms > 0 && now < end && next_zap < wake)
+			wake = next_zap;
+		timer.it_value.tv_sec = wake / 1000000000ULL;
+		timer.it_value.tv_nsec = wake % 1000000000ULL;
+		timerfd_settime(t->timerfd, TFD_TIMER_ABSTIME, &timer, NULL);
+
+		n = epoll_wait(t->epfd, events, 256, -1);
+		for (i = 0; i < (unsigned int) (n > 0 ? n : 0); i++) {
+			c = events[i].data.ptr;
+			if (c == NULL)
+				read(t->timerfd, &expirations, sizeof(expirations));
+			else if (c->fd >= 0 && (events[i].events & EPOLLIN))
+				load_receive(t, c);
+		}
+		now = now_ns();
+	}
+
+	for (i = 0; i < t->count; i++)
+		load_close(t, &t->conns[i], 0);
+	return NULL;
+}
+
+static void load_report(const struct load_stats * s, double elapsed) {
+	const struct histogram * h = &s->latency;
+
+	if (replay != NULL && speed > 0)
+		printf("Protocol %s, %u connections on %u threads, replaying %u requests from %s at speed %g\n",
+				protocol == LOAD_NEWCAMD ? "newcamd" : "cs378x", connections, threads, records, replay, speed);
+	else if (replay != NULL)
+		printf("Protocol %s, %u connections on %u threads, replaying %u requests from %s at maximum speed\n",
+				protocol == LOAD_NEWCAMD ? "newcamd" : "cs378x", connections, threads, records, replay);
+	else
+		printf("Protocol %s, %u connections on %u threads, %.0f requests/sec for %.0f seconds\n",
+				protocol == LOAD_NEWCAMD ? "newcamd" : "cs378x", connections, threads, rate, duration);
+	printf("Requests: %lu sent, %lu ok, %lu empty, %lu wrong, %lu timeouts, %lu zaps\n", s->sent, s->ok, s->empty, s->wrong, s->timeouts, s->zaps);
+	printf("Errors: %lu connection, %lu login\n", s->conn_errors, s->login_errors);
+	printf("Throughput: %.0f requests/sec\n", s->ok / elapsed);
+	printf("Latency (us): min %.1f, p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+			h->count > 0 ? h->min / 1e3 : 0, histogram_percentile(h, 50) / 1e3, histogram_percentile(h, 99) / 1e3,
+			histogram_percentile(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+int main(int argc, char *argv[]) {
+	static const unsigned char default_des_key[14] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x10, 0x11, 0x12, 0x13, 0x14};
+	unsigned char des_key[14];
+	const char * user = "user", * pass = "pass", * keyblock = "/var/cache/vmcam/keyblock";
+	unsigned int i, limit = 0, usage = 0;
+	struct load_thread * t;
+	struct load_stats total;
+	struct rlimit rl;
+	double start;
+
+	memcpy(des_key, default_des_key, sizeof(des_key));
+	for (i = 1; i < (unsigned int) argc && usage == 0; i++) {
+		if (i + 1 >= (unsigned int) argc) {
+			usage = 1;
+		} else if (strcmp(argv[i], "-proto") == 0) {
+			protocol = strcmp(argv[++i], "cs378x") == 0 ? LOAD_CS378X : LOAD_NEWCAMD;
+		} else if (strcmp(argv[i], "-port") == 0) {
+			port = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-u") == 0) {
+			user = argv[++i];
+		} else if (strcmp(argv[i], "-p") == 0) {
+			pass = argv[++i];
+		} else if (strcmp(argv[i], "-k") == 0) {
+			if (sscanf(argv[++i], "%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx",
+					&des_key[0], &des_key[1], &des_key[2], &des_key[3], &des_key[4], &des_key[5], &des_key[6],
+					&des_key[7], &des_key[8], &des_key[9], &des_key[10], &des_key[11], &des_key[12], &des_key[13]) != 14)
+				usage = 1;
+		} else if (strcmp(argv[i], "-kb") == 0) {
+			keyblock = argv[++i];
+		} else if (strcmp(argv[i], "-n") == 0) {
+			connections = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-w") == 0) {
+			threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-r") == 0) {
+			rate = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-t") == 0) {
+			duration = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-depth") == 0) {
+			depth = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-timeout") == 0) {
+			timeout_ms = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-ch") == 0) {
+			limit = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-zipf") == 0) {
+			zipf = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-zap") == 0) {
+			zap_interval_ms = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-zapshare") == 0) {
+			zap_fraction = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-replay") == 0) {
+			replay = argv[++i];
+		} else if (strcmp(argv[i], "-speed") == 0) {
+			speed = atof(argv[++i]);
+		} else {
+			usage = 1;
+		}
+	}
+
+	if (threads < 1 || connections < threads || depth < 1 || depth > LOAD_MAX_DEPTH || rate <= 0 || speed < 0)
+		usage = 1;
+
+	if (usage) {
+		printf("Usage: vmcam-load [options]\n\n");
+		printf("\t-proto [protocol]\tnewcamd or cs378x [default: newcamd]\n");
+		printf("\t-port [port]\t\tPort of vmcam on loopback [default: 15050 or 15080]\n");
+		printf("\t-u [username]\t\tUser to log in with [default: user]\n");
+		printf("\t-p [password]\t\tPassword of the user [default: pass]\n");
+		printf("\t-k [DES key]\t\tDES key for Newcamd [default: 0102030405060708091011121314]\n");
+		printf("\t-kb [keyblock]\t\tKeyblock vmcam serves [default: /var/cache/vmcam/keyblock]\n\n");
+		printf("\t-n [connections]\tConcurrent client connections [default: 100]\n");
+		printf("\t-w [threads]\t\tThreads sharing the connections [default: 1]\n");
+		printf("\t-r [rate]\t\tECM requests per second over all connections [default: 1000]\n");
+		printf("\t-t [seconds]\t\tDuration of the test [default: 10]\n");
+		printf("\t-depth [requests]\tMaximum requests in flight per connection [default: 8]\n");
+		printf("\t-timeout [ms]\t\tTime after which a request is lost [default: 2000]\n\n");
+		printf("\t-ch [channels]\t\tNumber of keyblock channels to request [default: all]\n");
+		printf("\t-zipf [exponent]\tZipf exponent of channel popularity, 0 is uniform [default: 0]\n");
+		printf("\t-zap [ms]\t\tInterval of zapping bursts, 0 to disable [default: 0]\n");
+		printf("\t-zapshare [fraction]\tShare of the connections zapping per burst [default: 0.1]\n\n");
+		printf("\t-replay [file]\t\tReplay a capture or ECM file instead of keyblock channels\n");
+		printf("\t-speed [factor]\t\tReplay speed relative to the capture, 0 for maximum [default: 1]\n");
+		return EXIT_FAILURE;
+	}
+
+	if (port == 0)
+		port = protocol == LOAD_NEWCAMD ? 15050 : 15080;
+
+	// Every connection needs a descriptor
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (account_table_add(user, pass, des_key) < 0 || (account = account_by_user(user)) == NULL)
+		return EXIT_FAILURE;
+
+	if (replay != NULL) {
+		zap_interval_ms = 0;
+		if (load_capture(replay) < 0)
+			return EXIT_FAILURE;
+	} else if (load_ecms(keyblock, limit) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	if ((t = calloc(threads, sizeof(struct load_thread))) == NULL)
+		return EXIT_FAILURE;
+
+	pthread_barrier_init(&started, NULL, threads + 1);
+	for (i = 0; i < threads; i++) {
+		t[i].index = i;
+		t[i].count = connections / threads + (i < connections % threads);
+		if ((t[i].conns = calloc(t[i].count, sizeof(struct load_conn))) == NULL || (t[i].epfd = epoll_create1(0)) < 0 ||
+				(t[i].timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+			return EXIT_FAILURE;
+
+		t[i].rng = 0x6c6f6164 + i * 0x9e3779b97f4a7c15ULL;
+		histogram_init(&t[i].stats.latency);
+		pthread_create(&t[i].thread, NULL, load_thread_run, &t[i]);
+	}
+
+	pthread_barrier_wait(&started);
+	start_ns = now_ns();
+	pthread_barrier_wait(&started);
+
+	memset(&total, 0, sizeof(total));
+	histogram_init(&total.latency);
+	for (i = 0; i < threads; i++) {
+		pthread_join(t[i].thread, NULL);
+		total.sent += t[i].stats.sent;
+		total.ok += t[i].stats.ok;
+		total.wrong += t[i].stats.wrong;
+		total.empty += t[i].stats.empty;
+		total.timeouts += t[i].stats.timeouts;
+		total.conn_errors += t[i].stats.conn_errors;
+		total.login_errors += t[i].stats.login_errors;
+		total.zaps += t[i].stats.zaps;
+		histogram_merge(&total.latency, &t[i].stats.latency);
+	}
+
+	start = (now_ns() - start_ns) / 1e9;
+	load_report(&total, replay != NULL || start < duration ? start : duration);
+	return total.sent == total.ok + total.empty && total.conn_errors == 0 && total.login_errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
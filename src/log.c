@@ -0,0 +1,379 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+#define LOG_RING_SLOTS 256
+#define LOG_MSG_MAX 512
+#define LOG_OUT_BUF (64 * 1024)
+#define LOG_HEX_MAX (LOG_MSG_MAX * 3)
+
+int debug_level;
+
+enum log_output {
+	LOG_TO_STDOUT,
+	LOG_TO_FILE,
+	LOG_TO_SYSLOG,
+};
+
+/*
+ * For hex dumps @text holds the prefix and its terminating zero followed
+ * by @hex_len raw bytes, they are only formatted by the writer.
+ */
+struct log_msg {
+	struct timespec time;
+	int level;
+	int hex_len;
+	char text[LOG_MSG_MAX];
+};
+
+/*
+ * Single producer ring owned by one thread. The thread fills the slot at
+ * @head and publishes it by advancing @head, the writer thread consumes
+ * from @tail. When the ring is full the message is counted in @dropped
+ * instead of waiting for the writer.
+ */
+struct log_ring {
+	struct log_ring * next;
+	unsigned int head;
+	unsigned int tail;
+	unsigned long dropped;
+	struct log_msg msgs[LOG_RING_SLOTS];
+};
+
+static struct log_ring * rings = NULL;
+static __thread struct log_ring * own_ring = NULL;
+static unsigned long lost = 0;			// Messages of threads without a ring
+static int running = 0;
+static int sleeping = 0;
+static int wake_fd = -1;
+static enum log_output output = LOG_TO_STDOUT;
+static FILE * log_file = NULL;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void log_emit(const struct timespec * time, int level, const char * text) {
+	static time_t last_sec = -1;
+	static char stamp[32];
+	struct tm tm;
+	FILE * out;
+
+	if (output == LOG_TO_SYSLOG) {
+		syslog(level == ERROR ? LOG_ERR : level == INFO ? LOG_INFO : LOG_DEBUG, "%s", text);
+		return;
+	}
+
+	// The date part only changes once a second
+	if (time->tv_sec != last_sec) {
+		localtime_r(&time->tv_sec, &tm);
+		strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+		last_sec = time->tv_sec;
+	}
+
+	out = output == LOG_TO_FILE ? log_file : stdout;
+	if (output == LOG_TO_STDOUT && level == ERROR) {
+		// Keep lines whole when stdout and stderr end up in the same file
+		fflush(stdout);
+		out = stderr;
+	}
+	fprintf(out, "%s.%03ld %s\n", stamp, time->tv_nsec / 1000000, text);
+}
+
+static void log_format_hex(char * out, const char * prefix, const unsigned char * data, int len) {
+	static const char digits[] = "0123456789abcdef";
+	int i, n;
+
+	n = snprintf(out, LOG_MSG_MAX, "%s", prefix);
+	if (n >= LOG_MSG_MAX)
+		n = LOG_MSG_MAX - 1;
+
+	for (i = 0; i < len && n + 3 < LOG_HEX_MAX; i++) {
+		out[n++] = ' ';
+		out[n++] = digits[data[i] >> 4];
+		out[n++] = digits[data[i] & 0xf];
+	}
+	out[n] = '\0';
+}
+
+static void log_emit_msg(const struct log_msg * msg) {
+	char text[LOG_HEX_MAX];
+	size_t prefix;
+
+	if (msg->hex_len == 0) {
+		log_emit(&msg->time, msg->level, msg->text);
+		return;
+	}
+
+	prefix = strlen(msg->text) + 1;
+	log_format_hex(text, msg->text, (const unsigned char *) msg->text + prefix, msg->hex_len);
+	log_emit(&msg->time, msg->level, text);
+}
+
+static void log_flush_output(void) {
+	if (output == LOG_TO_FILE) {
+		fflush(log_file);
+	} else if (output == LOG_TO_STDOUT) {
+		fflush(stdout);
+		fflush(stderr);
+	}
+}
+
+static struct log_ring * log_ring(void) {
+	struct log_ring * ring;
+
+	if (own_ring != NULL)
+		return own_ring;
+
+	if ((ring = calloc(1, sizeof(struct log_ring))) == NULL)
+		return NULL;
+
+	ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	own_ring = ring;
+	return ring;
+}
+
+static int time_before(const struct timespec * a, const struct timespec * b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Writes out everything queued in all rings, merged by time so messages
+ * of different threads stay in order. Returns the number written.
+ */
+static unsigned int log_drain(void) {
+	struct log_ring * ring, * first;
+	struct log_msg * msg;
+	unsigned long dropped = 0;
+	unsigned int count = 0;
+	struct timespec now;
+	char text[64];
+
+	pthread_mutex_lock(&drain_lock);
+	while (1) {
+		first = NULL;
+		for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+			if (ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+				continue;
+			if (first == NULL || time_before(&ring->msgs[ring->tail % LOG_RING_SLOTS].time, &first->msgs[first->tail % LOG_RING_SLOTS].time))
+				first = ring;
+		}
+		if (first == NULL)
+			break;
+
+		msg = &first->msgs[first->tail % LOG_RING_SLOTS];
+		log_emit_msg(msg);
+		__atomic_store_n(&first->tail, first->tail + 1, __ATOMIC_RELEASE);
+		count++;
+	}
+
+	for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+		dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+	dropped += __atomic_exchange_n(&lost, 0, __ATOMIC_RELAXED);
+	if (dropped > 0) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		snprintf(text, sizeof(text), "[LOG] Dropped %lu messages", dropped);
+		log_emit(&now, ERROR, text);
+	}
+
+	if (count > 0 || dropped > 0)
+		log_flush_output();
+	pthread_mutex_unlock(&drain_lock);
+	return count + (dropped > 0);
+}
+
+/*
+ * Writer thread, drains the rings until they are empty and then sleeps
+ * until a thread logs again. Producers only signal the eventfd when the
+ * writer announced it is going to sleep.
+ */
+static void *log_writer(void * arg) {
+	struct pollfd pfd;
+	eventfd_t value;
+
+	(void) arg;
+	pfd.fd = wake_fd;
+	pfd.events = POLLIN;
+	while (1) {
+		if (log_drain() > 0)
+			continue;
+
+		__atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+		if (log_drain() == 0 && poll(&pfd, 1, 1000) > 0)
+			eventfd_read(wake_fd, &value);
+		__atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+
+	return NULL;
+}
+
+static void log_write_sync(int level, const char * text) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	pthread_mutex_lock(&drain_lock);
+	log_emit(&now, level, text);
+	log_flush_output();
+	pthread_mutex_unlock(&drain_lock);
+}
+
+/*
+ * Returns the slot for the next message of this thread or NULL when the
+ * ring is full, in which case the message is counted as dropped.
+ */
+static struct log_msg * log_reserve(int level) {
+	struct log_ring * ring;
+	struct log_msg * msg;
+
+	if ((ring = log_ring()) == NULL) {
+		__atomic_fetch_add(&lost, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	msg = &ring->msgs[ring->head % LOG_RING_SLOTS];
+	clock_gettime(CLOCK_REALTIME, &msg->time);
+	msg->level = level;
+	msg->hex_len = 0;
+	return msg;
+}
+
+static void log_publish(void) {
+	__atomic_store_n(&own_ring->head, own_ring->head + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&sleeping, 0, __ATOMIC_RELAXED))
+		eventfd_write(wake_fd, 1);
+}
+
+/*
+ * Queues a message for the writer thread. Until the writer runs, or when
+ * it couldn't be started, messages are written straight away.
+ */
+void log_write(int level, const char * format, ...) {
+	struct log_msg * msg;
+	char text[LOG_MSG_MAX];
+	va_list args;
+
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		va_start(args, format);
+		vsnprintf(text, sizeof(text), format, args);
+		va_end(args);
+		log_write_sync(level, text);
+		return;
+	}
+
+	if ((msg = log_reserve(level)) == NULL)
+		return;
+
+	va_start(args, format);
+	vsnprintf(msg->text, sizeof(msg->text), format, args);
+	va_end(args);
+	log_publish();
+}
+
+/*
+ * Logs @prefix followed by @data as hex. Only the raw bytes are queued,
+ * the writer thread formats them.
+ */
+void log_write_hex(int level, const char * prefix, const unsigned char * data, int len) {
+	struct log_msg * msg;
+	char text[LOG_HEX_MAX];
+	size_t prefix_len = strlen(prefix) + 1;
+
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		log_format_hex(text, prefix, data, len);
+		log_write_sync(level, text);
+		return;
+	}
+
+	if (prefix_len >= LOG_MSG_MAX || (msg = log_reserve(level)) == NULL)
+		return;
+
+	if (len > (int) (LOG_MSG_MAX - prefix_len))
+		len = LOG_MSG_MAX - prefix_len;
+	memcpy(msg->text, prefix, prefix_len);
+	memcpy(msg->text + prefix_len, data, len);
+	msg->hex_len = len;
+	log_publish();
+}
+
+void log_flush(void) {
+	log_drain();
+}
+
+/*
+ * Starts the writer thread. @target is "stdout" (errors go to stderr),
+ * "syslog" or the path of a file to append to.
+ */
+int log_open(const char * target) {
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	fflush(stdout);
+	if (target == NULL || strcmp(target, "stdout") == 0) {
+		output = LOG_TO_STDOUT;
+	} else if (strcmp(target, "syslog") == 0) {
+		openlog("vmcam", LOG_PID, LOG_DAEMON);
+		output = LOG_TO_SYSLOG;
+	} else {
+		if ((log_file = fopen(target, "a")) == NULL) {
+			LOG(ERROR, "[LOG] Can't open log file %s: %s", target, strerror(errno));
+			return -1;
+		}
+		setvbuf(log_file, NULL, _IOFBF, LOG_OUT_BUF);
+		output = LOG_TO_FILE;
+	}
+
+	if ((wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+		LOG(ERROR, "[LOG] Can't create eventfd, logging synchronously: %s", strerror(errno));
+		return 0;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if ((errno = pthread_create(&thread, &attr, log_writer, NULL)) != 0) {
+		pthread_attr_destroy(&attr);
+		LOG(ERROR, "[LOG] Can't start log writer, logging synchronously: %s", strerror(errno));
+		return 0;
+	}
+	pthread_attr_destroy(&attr);
+
+	// Messages still queued when exiting, e.g. after err()
+	atexit(log_flush);
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
@@ -17,7 +17,21 @@
  * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define LOG(level, data...) if (level <= debug_level) { if (level == 0) { fprintf(stderr, data); fprintf(stderr, "\n"); } else { printf(data); printf("\n"); } fflush(stdout); };
+#ifndef LOG_H_
+#define LOG_H_
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL VERBOSE
+#endif
+
+/*
+ * Messages above LOG_MAX_LEVEL (configure --with-max-log-level) are
+ * compiled out, including the evaluation of their arguments. The runtime
+ * check is expected to fail, verbose logging is the exception.
+ */
+#define LOG_ENABLED(level) ((level) <= LOG_MAX_LEVEL && __builtin_expect((level) <= debug_level, 0))
+#define LOG(level, data...) if (LOG_ENABLED(level)) { log_write(level, data); };
+#define LOG_HEX(level, prefix, data, len) if (LOG_ENABLED(level)) { log_write_hex(level, prefix, data, len); };
 
 typedef enum {
 	ERROR,
@@ -26,4 +40,11 @@ typedef enum {
 	VERBOSE,
 } debuglevels;
 
-int debug_level;
+extern int debug_level;
+
+void log_write(int level, const char * format, ...) __attribute__((format(printf, 2, 3)));
+void log_write_hex(int level, const char * prefix, const unsigned char * data, int len);
+int log_open(const char * target);
+void log_flush(void);
+
+#endif /* LOG_H_ */
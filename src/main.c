@@ -27,87 +27,24 @@
 #include <arpa/inet.h>
 #include <err.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 
-#include "newcamd.h"
-#include "cs378x.h"
+#include "server.h"
+#include "account.h"
 #include "keyblock.h"
+#include "ecmcache.h"
+#include "aesdec.h"
+#include "capture.h"
+#include "refresh.h"
+#include "ssl-client.h"
 #include "vm_api.h"
 #include "log.h"
 #include "var_func.h"
 
-struct handler {
-	int sock;
-	void * (*callback)(void *);
-	char * user;
-	char * pass;
-	char * des_key;
-};
-
-struct client_data {
-	int client_fd;
-	char * user;
-	char * pass;
-	char * des_key;
-};
-
-void *handle_client(void * handle) {
-	struct sockaddr_in cli_addr;
-	socklen_t sin_len = sizeof(cli_addr);
-	struct handler* server = handle;
-	pthread_t thread;
-	struct client_data client_data;
+#define STATS_INTERVAL 300	// Seconds between ECM cache statistics
 
-	while (1) {
-		client_data.client_fd = accept(server->sock, (struct sockaddr *) &cli_addr, &sin_len);
-		if (client_data.client_fd == -1) {
-			perror("[VMCAM] Can't accept");
-			continue;
-		}
-
-		LOG(INFO, "[VMCAM] Got connection");
-
-		client_data.user = (*server).user;
-		client_data.pass = (*server).pass;
-		client_data.des_key = (*server).des_key;
-
-		pthread_attr_t attr;
-		pthread_attr_init(&attr);
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-		pthread_create(&thread, &attr, server->callback, &client_data);
-
-		pthread_attr_destroy(&attr);
-	}
-}
-
-void *handle_client_newcamd(void * client_data) {
-	struct client_data * cd = client_data;
-	int fd = (*cd).client_fd;
-	struct newcamd c;
-
-	c.client_fd = fd;
-	newcamd_init(&c, (*cd).user, (*cd).pass, (*cd).des_key);
-	while (newcamd_handle(&c, keyblock_analyse_file) != -1);
-	LOG(INFO, "[VMCAM] Connection closed");
-
-	close(fd);
-}
-
-void *handle_client_cs378x(void * client_data) {
-	struct client_data * cd = client_data;
-	int fd = (*cd).client_fd;
-	struct cs378x c;
-
-	c.client_fd = fd;
-	cs378x_init(&c, (*cd).user, (*cd).pass);
-	while (cs378x_handle(&c, keyblock_analyse_file) != -1);
-	LOG(INFO, "[VMCAM] Connection closed");
-
-	close(fd);
-}
-
-int open_socket(char* interface, char* host, int port) {
+int open_socket(char* interface, char* host, int port, int backlog, int reuseport) {
 	int one = 1;
 	struct sockaddr_in svr_addr;
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -116,6 +53,8 @@ int open_socket(char* interface, char* host, int port) {
 		err(1, "[VMCAM] Can't open socket");
 
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(int)) == -1)
+		err(1, "[VMCAM] Can't enable SO_REUSEPORT for %s", interface);
 
 	svr_addr.sin_family = AF_INET;
 	inet_aton(host, &svr_addr.sin_addr);
@@ -126,7 +65,10 @@ int open_socket(char* interface, char* host, int port) {
 		err(1, "[VMCAM] Can't bind on %s:%d for %s", host, port, interface);
 	}
 
-	listen(sock, 5);
+	if (listen(sock, backlog) == -1) {
+		close(sock);
+		err(1, "[VMCAM] Can't listen on %s:%d for %s", host, port, interface);
+	}
 	LOG(INFO, "[VMCAM] Start %s server on port %d", interface, port);
 
 	return sock;
@@ -135,6 +77,7 @@ int open_socket(char* interface, char* host, int port) {
 int main(int argc, char *argv[]) {
 	int ret;
 	int i;
+	unsigned int n;
 	int usage = 0;
 	int initial = 1;
 
@@ -147,13 +90,33 @@ int main(int argc, char *argv[]) {
 	char * vm_VKS_server = NULL;
 	unsigned int vm_VCAS_port = 0;
 	unsigned int vm_VKS_port = 0;
-	unsigned int vm_key_interval = 300;
+	unsigned int vm_key_interval = 3600;
+	unsigned int session_delay = 500;
+	unsigned int keys_delay = 1000;
+	unsigned int refresh_delay = 0;
+	unsigned int refresh_margin = 300;
+	unsigned int refresh_jitter = 10;
+	time_t fetched;
 
 	unsigned int keyblockonly = 0;
 	unsigned int port_cs378x = 15080;
 	unsigned int port_newcamd = 15050;
+	unsigned int workers = 0;
+	unsigned int worker_stack_kb = 0;
+	unsigned int listen_backlog = 1024;
+	unsigned int reuseport = 0;
+	char * io_backend = NULL;
+	char * log_output = NULL;
+	char * ecm_capture = NULL;
+	unsigned int ecm_cache_size = 4096;
+	unsigned int ecm_cache_ttl = 10;
+	struct ecm_cache_stats cache_stats;
 	char * user = NULL;
 	char * pass = NULL;
+	char ** accounts = NULL;
+	unsigned int account_lines = 0;
+	int user_set = 0;
+	char * sep;
 	char des_key[14];
         char default_des_key[14] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x10, 0x11, 0x12, 0x13, 0x14};
         
@@ -162,13 +125,11 @@ int main(int argc, char *argv[]) {
 	char * host = NULL;
 	int vm_protocolVersion = 1154;
         int debug = -1;
-	struct handler newcamd_handler, cs378x_handler;
-	pthread_t thread;
 	debug_level = 0;
 
         FILE * fp;
         int scan;
-        char key[31], value[31];
+        char key[31], value[256];
 
 	printf("VMCam - VCAS SoftCAM for IPTV\n");
 
@@ -188,7 +149,7 @@ int main(int argc, char *argv[]) {
 				printf("Need to provide a config file\n");
 				return -1;
 			}
-			config = argv[i+1];
+			str_realloc_copy(&config, argv[i+1]);
 			i++;
 		}
 	}
@@ -222,16 +183,56 @@ int main(int argc, char *argv[]) {
 					str_realloc_copy(&vm_api_company, value);
                                 } else if (strcmp(key, "KEY_INTERVAL") == 0) {
 	                                vm_key_interval = atoi(value);
+				} else if (strcmp(key, "REFRESH_MARGIN") == 0) {
+					refresh_margin = atoi(value);
+				} else if (strcmp(key, "REFRESH_JITTER") == 0) {
+					refresh_jitter = atoi(value);
+				} else if (strcmp(key, "SESSION_DELAY") == 0) {
+					session_delay = atoi(value);
+				} else if (strcmp(key, "KEYS_DELAY") == 0) {
+					keys_delay = atoi(value);
+				} else if (strcmp(key, "TLS_LEGACY") == 0) {
+					ssl_client_set_legacy(atoi(value));
+				} else if (strcmp(key, "REFRESH_TIMEOUT") == 0) {
+					if (refresh_set_timeout(value) < 0)
+						return -1;
 				} else if (strcmp(key, "NEWCAMD_PORT") == 0) {
 					port_newcamd = atoi(value);
 				} else if (strcmp(key, "CS378X_PORT") == 0) {
 					port_cs378x = atoi(value);
+				} else if (strcmp(key, "WORKERS") == 0) {
+					workers = atoi(value);
+				} else if (strcmp(key, "LISTEN_BACKLOG") == 0) {
+					listen_backlog = atoi(value);
+				} else if (strcmp(key, "LOG_OUTPUT") == 0) {
+					str_realloc_copy(&log_output, value);
+				} else if (strcmp(key, "ECM_CAPTURE") == 0) {
+					str_realloc_copy(&ecm_capture, value);
+				} else if (strcmp(key, "IO_BACKEND") == 0) {
+					str_realloc_copy(&io_backend, value);
+				} else if (strcmp(key, "REUSEPORT") == 0) {
+					reuseport = atoi(value);
+				} else if (strcmp(key, "WORKER_STACK_SIZE") == 0) {
+					worker_stack_kb = atoi(value);
+				} else if (strcmp(key, "ECM_CACHE_SIZE") == 0) {
+					ecm_cache_size = atoi(value);
+				} else if (strcmp(key, "ECM_CACHE_TTL") == 0) {
+					ecm_cache_ttl = atoi(value);
 				} else if (strcmp(key, "LISTEN_IP") == 0) {
 					str_realloc_copy(&host, value);
 				} else if (strcmp(key, "USERNAME") == 0) {
 					str_realloc_copy(&user, value);
+					user_set = 1;
 				} else if (strcmp(key, "PASSWORD") == 0) {
 					str_realloc_copy(&pass, value);
+				} else if (strcmp(key, "ACCOUNT") == 0) {
+					// Added once the DES key is final
+					if ((accounts = realloc(accounts, (account_lines + 1) * sizeof(char *))) == NULL) {
+						LOG(ERROR, "[VMCAM] Not enough memory for accounts");
+						return -1;
+					}
+					accounts[account_lines] = NULL;
+					str_realloc_copy(&accounts[account_lines++], value);
 				} else if (strcmp(key, "DES_KEY") == 0) {
 					ret = sscanf(value, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
 							&des_key[0], &des_key[1], &des_key[2], &des_key[3],
@@ -257,6 +258,20 @@ int main(int argc, char *argv[]) {
 	for (i = 1; i < argc && usage == 0; i++) {
 		if (strcmp(argv[i], "-c") == 0) {
 			i++;
+		} else if (strcmp(argv[i], "-lo") == 0) {
+				if (i+1 >= argc) {
+					printf("Need to provide the log output\n");
+					return -1;
+				}
+				str_realloc_copy(&log_output, argv[i+1]);
+				i++;
+		} else if (strcmp(argv[i], "-capture") == 0) {
+				if (i+1 >= argc) {
+					printf("Need to provide the capture file\n");
+					return -1;
+				}
+				str_realloc_copy(&ecm_capture, argv[i+1]);
+				i++;
 		} else if (strcmp(argv[i], "-a") == 0) {
 				if (i+1 >= argc) {
 					printf("Need to provide a MAC address\n");
@@ -310,6 +325,7 @@ int main(int argc, char *argv[]) {
 					return -1;
 				}
 				str_realloc_copy(&user, argv[i+1]);
+				user_set = 1;
 				i++;
 		} else if (strcmp(argv[i], "-p") == 0) {
 				if (i+1 >= argc) {
@@ -340,6 +356,50 @@ int main(int argc, char *argv[]) {
 				}
 				str_realloc_copy(&host, argv[i+1]);
 				i++;
+		} else if (strcmp(argv[i], "-w") == 0) {
+				if (i+1 >= argc) {
+					printf("Need to provide the number of worker threads\n");
+					return -1;
+				}
+				workers = atoi(argv[i+1]);
+				i++;
+		} else if (strcmp(argv[i], "-lb") == 0) {
+				if (i+1 >= argc) {
+					printf("Need to provide the listen backlog\n");
+					return -1;
+				}
+				listen_backlog = atoi(argv[i+1]);
+				i++;
+		} else if (strcmp(argv[i], "-io") == 0) {
+				if (i+1 >= argc) {
+					printf("Need to provide the I/O backend\n");
+					return -1;
+				}
+				str_realloc_copy(&io_backend, argv[i+1]);
+				i++;
+		} else if (strcmp(argv[i], "-reuseport") == 0) {
+				reuseport = 1;
+		} else if (strcmp(argv[i], "-ws") == 0) {
+				if (i+1 >= argc) {
+					printf("Need to provide the worker stack size\n");
+					return -1;
+				}
+				worker_stack_kb = atoi(argv[i+1]);
+				i++;
+		} else if (strcmp(argv[i], "-cs") == 0) {
+				if (i+1 >= argc) {
+					printf("Need to provide the ECM cache size\n");
+					return -1;
+				}
+				ecm_cache_size = atoi(argv[i+1]);
+				i++;
+		} else if (strcmp(argv[i], "-ct") == 0) {
+				if (i+1 >= argc) {
+					printf("Need to provide the ECM cache TTL\n");
+					return -1;
+				}
+				ecm_cache_ttl = atoi(argv[i+1]);
+				i++;
 		} else if (strcmp(argv[i], "-noinitial") == 0) {
 				initial = 0;
 		} else if (strcmp(argv[i], "-ps") == 0) {
@@ -384,6 +444,42 @@ int main(int argc, char *argv[]) {
 				}
 				vm_key_interval = atoi(argv[i+1]);
 				i++;
+		} else if (strcmp(argv[i], "-rm") == 0) {
+				if (i+1 >= argc) {
+					printf("Need margin before a master key rollover\n");
+					return -1;
+				}
+				refresh_margin = atoi(argv[i+1]);
+				i++;
+		} else if (strcmp(argv[i], "-rj") == 0) {
+				if (i+1 >= argc) {
+					printf("Need percentage of refresh jitter\n");
+					return -1;
+				}
+				refresh_jitter = atoi(argv[i+1]);
+				i++;
+		} else if (strcmp(argv[i], "-sd") == 0) {
+				if (i+1 >= argc) {
+					printf("Need delay after getting a session key\n");
+					return -1;
+				}
+				session_delay = atoi(argv[i+1]);
+				i++;
+		} else if (strcmp(argv[i], "-kd") == 0) {
+				if (i+1 >= argc) {
+					printf("Need delay before getting the keys\n");
+					return -1;
+				}
+				keys_delay = atoi(argv[i+1]);
+				i++;
+		} else if (strcmp(argv[i], "-rt") == 0) {
+				if (i+1 >= argc) {
+					printf("Need a refresh phase timeout\n");
+					return -1;
+				}
+				if (refresh_set_timeout(argv[i+1]) < 0)
+					return -1;
+				i++;
 		} else if (strcmp(argv[i], "-e") == 0) {
 				if (i+1 >= argc) {
 					printf("Need name of cache directory\n");
@@ -404,7 +500,8 @@ int main(int argc, char *argv[]) {
 	if (usage) {
 		printf("Usage: vmcam [options]\n\n");
 		printf("\t-e [directory]\t\tDirectory to store cache files [default: /var/cache/vmcam]\n");
-		printf("\t-d [debug level]\tSet debug level [default: 0]\n\n");
+		printf("\t-d [debug level]\tSet debug level [default: 0]\n");
+		printf("\t-lo [output]\t\tLog to stdout, syslog or a file [default: stdout]\n\n");
 		printf("  VCAS/VKS:\n\n");
 		printf("\t-c [configfile]\t\tVCAS configfile [default: vmcam.ini]\n");
 		printf("\t-a [Amino MAC]\t\tYour Amino MAC address [format: 010203040506]\n");
@@ -415,7 +512,12 @@ int main(int argc, char *argv[]) {
 		printf("\t-ps [VCAS port]\t\tSet VCAS port number to connect to\n");
 		printf("\t-pk [VKS port]\t\tSet VKS port number to connect to\n");
 		printf("\t-C [Company name]\tSet name of company for key retreival\n");
-		printf("\t-t [interval]\t\tInterval for updating keys [default: 300]\n");
+		printf("\t-t [interval]\t\tLongest interval between key updates, at least 60 [default: 3600]\n");
+		printf("\t-rm [seconds]\t\tUpdate keys this long before a master key rollover [default: 300]\n");
+		printf("\t-rj [percent]\t\tRandom part of the update interval taken off [default: 10]\n");
+		printf("\t-sd [ms]\t\tDelay after getting a session key [default: 500]\n");
+		printf("\t-kd [ms]\t\tDelay before getting the keys [default: 1000]\n");
+		printf("\t-rt [phase:seconds]\tTimeout of a refresh phase: session, certificate, password or keys\n");
 		printf("\t-noinitial\t\tSkip initial keyblock retrieval\n\n");
 		printf("  Newcamd/CS378x:\n\n");
 		printf("\t-pn [Newcamd port]\tSet Newcamd port number or 0 to disable [default: 15050]\n");
@@ -424,10 +526,28 @@ int main(int argc, char *argv[]) {
 		printf("\t-u [username]\t\tSet allowed user on server [default: user]\n");
 		printf("\t-p [password]\t\tSet password for server [default: pass]\n");
 		printf("\t-k [DES key]\t\tSet DES key for Newcamd [default: 0102030405060708091011121314]\n");
+		printf("\t-w [workers]\t\tNumber of worker threads for clients [default: number of CPUs]\n");
+		printf("\t-lb [backlog]\t\tListen backlog for client connections [default: 1024]\n");
+		printf("\t-io [backend]\t\tI/O backend for clients, epoll or uring [default: epoll]\n");
+		printf("\t-reuseport\t\tOne SO_REUSEPORT listener per worker, workers pinned to CPUs\n");
+		printf("\t-ws [KB]\t\tStack size of worker threads [default: system default]\n");
+		printf("\t-cs [entries]\t\tSize of the ECM cache or 0 to disable [default: 4096]\n");
+		printf("\t-ct [seconds]\t\tTime an ECM stays in the cache [default: 10]\n");
 		printf("\t-keyblockonly\t\tDisable Newcamd and CS378x (will override related port settings)\n");
+		printf("\t-capture [file]\t\tRecord incoming ECM requests to a file for replay\n");
 		return -1;
 	}
 
+	if (log_open(log_output) < 0)
+		return EXIT_FAILURE;
+	free(log_output);
+
+	if (ecm_capture != NULL) {
+		if (capture_open(ecm_capture) < 0)
+			return EXIT_FAILURE;
+		free(ecm_capture);
+	}
+
 	vm_config(vm_VCAS_server, vm_VCAS_port, vm_VKS_server, vm_VKS_port, vm_api_company, vm_cache_dir, vm_aminoMAC, vm_machineID, vm_protocolVersion);
         free(vm_VCAS_server);
         free(vm_VKS_server);
@@ -444,44 +564,90 @@ int main(int argc, char *argv[]) {
 	if ((ret = init_vmapi()) == EXIT_FAILURE)
 		return ret;
 
-	if (initial) {
-		if ((ret = load_keyblock()) == EXIT_FAILURE)
-			return ret;
+	aesdec_init(0);
+	LOG(INFO, "[VMCAM] Using %s AES engine for ECM decryption", aesdec_engine());
+
+	/*
+	 * Serve the cached keyblock while the refresh runs in the background.
+	 * A validated snapshot is refreshed on the schedule of its fetch time
+	 * instead of now.
+	 */
+	if (refresh_set_schedule(vm_key_interval, refresh_margin, refresh_jitter) < 0)
+		return EXIT_FAILURE;
+
+	if (!initial) {
+		if (load_keyblock_file(&fetched) < 0)
+			LOG(ERROR, "[VMCAM] No cached keyblock available, waiting for next update");
+		refresh_delay = refresh_schedule(time(NULL));
+	} else if (load_keyblock_file(&fetched) == 0 && fetched > 0 && (refresh_delay = refresh_schedule(fetched)) > 0) {
+		LOG(INFO, "[VMCAM] Warm start from keyblock fetched %ld seconds ago", (long) (time(NULL) - fetched));
 	}
 
-	if (port_newcamd > 0) {
-		pthread_attr_t attr;
-		pthread_attr_init(&attr);
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (ecm_cache_init(ecm_cache_size, ecm_cache_ttl) < 0)
+		return EXIT_FAILURE;
 
-		newcamd_handler.sock = open_socket("Newcamd", host, port_newcamd);
-		newcamd_handler.callback = handle_client_newcamd;
-		newcamd_handler.user = user;
-		newcamd_handler.pass = pass;
-		newcamd_handler.des_key = des_key;
-		pthread_create(&thread, &attr, handle_client, &newcamd_handler);
+	if (port_newcamd > 0 || port_cs378x > 0) {
+		// The default user is only served next to ACCOUNT entries when set explicitly
+		if ((account_lines == 0 || user_set) && account_table_add(user, pass, (unsigned char *) des_key) < 0)
+			return EXIT_FAILURE;
 
-		pthread_attr_destroy(&attr);
+		for (n = 0; n < account_lines; n++) {
+			if ((sep = strchr(accounts[n], ':')) == NULL) {
+				LOG(ERROR, "[VMCAM] Account '%s' is not in user:password format", accounts[n]);
+				return EXIT_FAILURE;
+			}
+			*sep = '\0';
+			if (account_table_add(accounts[n], sep + 1, (unsigned char *) des_key) < 0)
+				return EXIT_FAILURE;
+		}
+		LOG(INFO, "[VMCAM] Serving %u accounts", account_table_count());
+	}
+
+	for (n = 0; n < account_lines; n++)
+		free(accounts[n]);
+	free(accounts);
+
+	if (workers == 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (io_backend != NULL) {
+		if (strcmp(io_backend, "uring") == 0) {
+			if (server_set_backend(SERVER_URING) < 0)
+				LOG(ERROR, "[VMCAM] io_uring isn't supported here, falling back to epoll");
+		} else if (strcmp(io_backend, "epoll") != 0) {
+			LOG(ERROR, "[VMCAM] Unknown I/O backend %s", io_backend);
+			return EXIT_FAILURE;
+		}
+		free(io_backend);
 	}
 
-	if (port_cs378x > 0) {
-		pthread_attr_t attr;
-		pthread_attr_init(&attr);
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	// With SO_REUSEPORT every worker gets its own listener per port, otherwise they share one
+	for (n = 0; n < (reuseport ? workers : 1); n++) {
+		if (port_newcamd > 0 && server_add_listener(open_socket("Newcamd", host, port_newcamd, listen_backlog, reuseport),
+				SERVER_NEWCAMD, (unsigned char *) des_key, reuseport ? (int) n : -1) < 0)
+			return EXIT_FAILURE;
 
-		cs378x_handler.sock = open_socket("CS378x", host, port_cs378x);
-		cs378x_handler.callback = handle_client_cs378x;
-		cs378x_handler.user = user;
-		cs378x_handler.pass = pass;
-		cs378x_handler.des_key = NULL;
-		pthread_create(&thread, &attr, handle_client, &cs378x_handler);
+		if (port_cs378x > 0 && server_add_listener(open_socket("CS378x", host, port_cs378x, listen_backlog, reuseport),
+				SERVER_CS378X, (unsigned char *) des_key, reuseport ? (int) n : -1) < 0)
+			return EXIT_FAILURE;
+	}
 
-		pthread_attr_destroy(&attr);
+	if (port_newcamd > 0 || port_cs378x > 0) {
+		if (server_start(workers, (size_t) worker_stack_kb * 1024, reuseport, keyblock_analyse_batch) < 0)
+			return EXIT_FAILURE;
 	}
 
+	refresh_set_delays(session_delay, keys_delay);
+	if (refresh_start(refresh_delay) < 0)
+		return EXIT_FAILURE;
+
 	while (1) {
-		LOG(INFO, "[VMCAM] Next keyblock update in %d seconds", vm_key_interval);
-		sleep(vm_key_interval);
-		load_keyblock();
+		sleep(STATS_INTERVAL);
+
+		ecm_cache_stats(&cache_stats);
+		if (cache_stats.slots > 0)
+			LOG(INFO, "[VMCAM] ECM cache %u slots, %llu hits, %llu misses, %llu inserts, %llu evictions", cache_stats.slots,
+					(unsigned long long) cache_stats.hits, (unsigned long long) cache_stats.misses,
+					(unsigned long long) cache_stats.inserts, (unsigned long long) cache_stats.evictions);
 	}
 }
@@ -0,0 +1,717 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include <openssl/rsa.h>
+#include <openssl/rc4.h>
+#include <openssl/md5.h>
+#include <openssl/rand.h>
+
+#include "synth.h"
+#include "log.h"
+
+/*
+ * Stand-in for the operator VCAS and VKS servers, speaking the 1154/1155
+ * message formats vm_api.c uses. CreateSessionKey and getCertificate are
+ * served over SSL on the VCAS port, the RC4 encrypted password messages on
+ * the port after it and GetAllChannelKeys on the VKS port. Responses only
+ * carry what vm_api.c reads from them.
+ */
+
+#define MOCK_BUF_LEN 8192
+#define MOCK_KEYS_LEN (4 + 65536 * 108)	// Response with an entry for every channel
+#define MOCK_SESSIONS 256
+#define MOCK_CLIENTS 256
+#define MOCK_TIMESTAMP_LEN 19
+#define MOCK_SKI_LEN 40
+
+enum mock_op {MOCK_SESSION, MOCK_CERT, MOCK_SAVE_PW, MOCK_GET_PW, MOCK_KEYS, MOCK_OPS};
+
+static const char * mock_op_names[MOCK_OPS] = {"session", "cert", "savepw", "getpw", "keys"};
+static const char * mock_op_messages[MOCK_OPS] = {"CreateSessionKey", "getCertificate", "SaveEncryptedPassword", "GetEncryptedPassword", "GetAllChannelKeys"};
+static const int mock_op_fields[MOCK_OPS] = {0, 0, 6, 4, 8};	// Encrypted fields sent by vm_api.c
+
+struct mock_session {
+	char timestamp[MOCK_TIMESTAMP_LEN + 1];
+	unsigned char key[16];
+};
+
+// Certificate issued by getCertificate, looked up by its SKI
+struct mock_client {
+	char ski[MOCK_SKI_LEN + 1];
+	EVP_PKEY * key;
+	char password[65];
+};
+
+struct mock_listener {
+	int sock;
+	int ssl;
+};
+
+static unsigned int delays[MOCK_OPS];		// Milliseconds before replying
+static unsigned int failures[MOCK_OPS];		// Percentage of requests dropped
+static int strict = 0;				// Reject unknown SKIs and bad signatures
+
+static unsigned int channels = 100, first_channel = 1000;
+static uint64_t seed = 1;
+static unsigned char * keyblock_file = NULL;
+static size_t keyblock_file_len;
+
+static SSL_CTX * ssl_ctx;
+static EVP_PKEY * ca_key;
+static X509 * ca_cert;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mock_session sessions[MOCK_SESSIONS];
+static struct mock_client clients[MOCK_CLIENTS];
+static unsigned int session_count, client_count, serial = 1;
+
+static EVP_PKEY * mock_rsa_key(int bits) {
+	EVP_PKEY_CTX * ctx;
+	EVP_PKEY * key = NULL;
+
+	if ((ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL)) == NULL)
+		return NULL;
+
+	if (EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, bits) <= 0 || EVP_PKEY_keygen(ctx, &key) <= 0)
+		key = NULL;
+
+	EVP_PKEY_CTX_free(ctx);
+	return key;
+}
+
+/*
+ * Issues a certificate for @key with a subject key identifier, self-signed
+ * when there is no CA yet.
+ */
+static X509 * mock_certificate(X509_NAME * subject, EVP_PKEY * key, unsigned int days) {
+	X509_EXTENSION * ext;
+	X509V3_CTX ctx;
+	X509 * cert;
+
+	if ((cert = X509_new()) == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&lock);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), serial++);
+	pthread_mutex_unlock(&lock);
+
+	X509_set_version(cert, 2);
+	X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(cert), days * 86400L);
+	X509_set_subject_name(cert, subject);
+	X509_set_issuer_name(cert, ca_cert != NULL ? X509_get_subject_name(ca_cert) : subject);
+	X509_set_pubkey(cert, key);
+
+	X509V3_set_ctx(&ctx, ca_cert != NULL ? ca_cert : cert, cert, NULL, NULL, 0);
+	if ((ext = X509V3_EXT_conf_nid(NULL, &ctx, NID_subject_key_identifier, "hash")) == NULL) {
+		X509_free(cert);
+		return NULL;
+	}
+	X509_add_ext(cert, ext, -1);
+	X509_EXTENSION_free(ext);
+
+	if (X509_sign(cert, ca_key, EVP_sha256()) <= 0) {
+		X509_free(cert);
+		return NULL;
+	}
+	return cert;
+}
+
+// Formats the SKI the way vm_api.c sends it, 20 bytes as upper case hex
+static void mock_ski(X509 * cert, char * ski) {
+	const ASN1_OCTET_STRING * id = X509_get0_subject_key_id(cert);
+	int i;
+
+	ski[0] = '\0';
+	for (i = 0; id != NULL && i < id->length && i < MOCK_SKI_LEN / 2; i++)
+		sprintf(ski + i * 2, "%02X", id->data[i]);
+}
+
+static int mock_init_ssl(void) {
+	X509_NAME * name;
+
+	if ((ca_key = mock_rsa_key(2048)) == NULL || (name = X509_NAME_new()) == NULL)
+		return -1;
+
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "vmcam mock VCAS", -1, -1, 0);
+	ca_cert = mock_certificate(name, ca_key, 3650);
+	X509_NAME_free(name);
+	if (ca_cert == NULL)
+		return -1;
+
+	// vm_api.c still asks for TLS 1.0 with legacy ciphers
+	if ((ssl_ctx = SSL_CTX_new(TLS_server_method())) == NULL)
+		return -1;
+	SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_VERSION);
+	SSL_CTX_set_cipher_list(ssl_ctx, "DEFAULT:@SECLEVEL=0");
+	if (SSL_CTX_use_certificate(ssl_ctx, ca_cert) != 1 || SSL_CTX_use_PrivateKey(ssl_ctx, ca_key) != 1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Splits @msg on '~' after skipping the 1154 or 1155 header, returns the
+ * number of fields.
+ */
+static int mock_fields(char * msg, char ** fields, int max) {
+	int n = 0;
+
+	if (strncmp(msg, "1155~", 5) == 0 && strlen(msg) >= 11)
+		msg += 11;
+	else if (strncmp(msg, "1154~", 5) == 0)
+		msg += 5;
+
+	while (n < max && *msg != '\0') {
+		fields[n++] = msg;
+		if ((msg = strchr(msg, '~')) == NULL)
+			break;
+		*msg++ = '\0';
+	}
+	return n;
+}
+
+static int mock_header_len(const unsigned char * msg, int len) {
+	if (len >= 11 && memcmp(msg, "1155~", 5) == 0)
+		return 11;
+	if (len >= 5 && memcmp(msg, "1154~", 5) == 0)
+		return 5;
+	return -1;
+}
+
+static enum mock_op mock_find_op(const char * name) {
+	int op;
+
+	for (op = 0; op < MOCK_OPS; op++) {
+		if (strcmp(name, mock_op_messages[op]) == 0)
+			break;
+	}
+	return op;
+}
+
+// Applies the configured delay, returns -1 when the request should fail
+static int mock_delay(enum mock_op op) {
+	uint32_t r;
+
+	if (delays[op] > 0)
+		usleep(delays[op] * 1000);
+
+	RAND_bytes((unsigned char *) &r, sizeof(r));
+	if (failures[op] > 0 && r % 100 < failures[op]) {
+		LOG(INFO, "[MOCK] Failing %s", mock_op_messages[op]);
+		return -1;
+	}
+	return 0;
+}
+
+static const struct mock_session * mock_session(const char * timestamp) {
+	unsigned int i;
+
+	for (i = 0; i < MOCK_SESSIONS && i < session_count; i++) {
+		if (strcmp(sessions[i].timestamp, timestamp) == 0)
+			return &sessions[i];
+	}
+	return NULL;
+}
+
+static struct mock_client * mock_client(const char * ski) {
+	unsigned int i;
+
+	for (i = 0; i < MOCK_CLIENTS && i < client_count; i++) {
+		if (strcmp(clients[i].ski, ski) == 0)
+			return &clients[i];
+	}
+	return NULL;
+}
+
+static int mock_create_session(unsigned char * resp) {
+	struct mock_session * s;
+
+	pthread_mutex_lock(&lock);
+	s = &sessions[session_count % MOCK_SESSIONS];
+	snprintf(s->timestamp, sizeof(s->timestamp), "%010ld%09u", (long) time(NULL), session_count++);
+	RAND_bytes(s->key, sizeof(s->key));
+
+	memset(resp, 0, 48);
+	resp[3] = 44;
+	memcpy(resp + 4, s->key, 16);
+	memcpy(resp + 20, s->timestamp, MOCK_TIMESTAMP_LEN);
+	pthread_mutex_unlock(&lock);
+
+	LOG(INFO, "[MOCK] Created session %s", s->timestamp);
+	return 48;
+}
+
+static int mock_issue_certificate(char ** fields, int n, unsigned char * resp, int size) {
+	struct mock_client * client;
+	X509_REQ * req = NULL;
+	EVP_PKEY * key = NULL;
+	X509 * cert = NULL;
+	unsigned char * der;
+	int len = -1;
+	BIO * bio;
+
+	if (n < 6 || (bio = BIO_new_mem_buf(fields[5], -1)) == NULL)
+		return -1;
+
+	req = PEM_read_bio_X509_REQ(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (req == NULL || (key = X509_REQ_get_pubkey(req)) == NULL || (cert = mock_certificate(X509_REQ_get_subject_name(req), key, 365)) == NULL) {
+		LOG(ERROR, "[MOCK] Invalid certificate request");
+		goto cleanup;
+	}
+
+	if ((len = i2d_X509(cert, NULL)) <= 0 || len + 12 > size) {
+		len = -1;
+		goto cleanup;
+	}
+
+	memset(resp, 0, 12);
+	der = resp + 12;
+	i2d_X509(cert, &der);
+
+	pthread_mutex_lock(&lock);
+	client = &clients[client_count++ % MOCK_CLIENTS];
+	EVP_PKEY_free(client->key);
+	client->key = key;
+	client->password[0] = '\0';
+	mock_ski(cert, client->ski);
+	LOG(INFO, "[MOCK] Issued certificate with SKI %s", client->ski);
+	pthread_mutex_unlock(&lock);
+
+	key = NULL;
+	len += 12;
+	resp[0] = (len - 4) >> 24;
+	resp[1] = (len - 4) >> 16;
+	resp[2] = (len - 4) >> 8;
+	resp[3] = len - 4;
+cleanup:
+	EVP_PKEY_free(key);
+	X509_free(cert);
+	X509_REQ_free(req);
+	return len;
+}
+
+// Checks the RSA signature over MD5 of the session timestamp
+static int mock_check_signature(const struct mock_client * client, const char * timestamp, const char * hex) {
+	unsigned char hash[MD5_DIGEST_LENGTH], sig[512];
+	unsigned int i, len = strlen(hex) / 2;
+	RSA * rsa;
+	int ok;
+
+	if (len > sizeof(sig) || (rsa = EVP_PKEY_get1_RSA(client->key)) == NULL)
+		return -1;
+
+	for (i = 0; i < len; i++)
+		sscanf(hex + i * 2, "%2hhx", &sig[i]);
+
+	MD5((const unsigned char *) timestamp, MOCK_TIMESTAMP_LEN, hash);
+	ok = RSA_verify(NID_md5, hash, sizeof(hash), sig, len, rsa);
+	RSA_free(rsa);
+	return ok == 1 ? 0 : -1;
+}
+
+/*
+ * The header and the company, timestamp and machine id fields of the RC4
+ * messages are sent in plain. Returns the length of that part and copies
+ * the timestamp and the key of its session.
+ */
+static int mock_tcp_session(const unsigned char * msg, int len, char * timestamp, unsigned char * key) {
+	const struct mock_session * session;
+	int header, plain_len, start = 0, end = 0, i;
+
+	if ((header = mock_header_len(msg, len)) < 0)
+		return -1;
+
+	for (plain_len = header, i = 0; plain_len < len && i < 3; plain_len++) {
+		if (msg[plain_len] != '~')
+			continue;
+		if (++i == 1)
+			start = plain_len + 1;
+		else if (i == 2)
+			end = plain_len;
+	}
+	if (i < 3 || end - start != MOCK_TIMESTAMP_LEN)
+		return -1;
+
+	memcpy(timestamp, msg + start, MOCK_TIMESTAMP_LEN);
+	timestamp[MOCK_TIMESTAMP_LEN] = '\0';
+
+	pthread_mutex_lock(&lock);
+	if ((session = mock_session(timestamp)) != NULL)
+		memcpy(key, session->key, 16);
+	pthread_mutex_unlock(&lock);
+	return session != NULL ? plain_len : -1;
+}
+
+// Whether an 1154 message, which has no length, has all its fields
+static int mock_tcp_complete(const unsigned char * msg, int len) {
+	char timestamp[MOCK_TIMESTAMP_LEN + 1], text[MOCK_BUF_LEN + 1], * fields[16];
+	unsigned char key[16];
+	int plain_len, n, tildes = 0, i;
+	enum mock_op op;
+	RC4_KEY rc4key;
+
+	if ((plain_len = mock_tcp_session(msg, len, timestamp, key)) < 0 || len - plain_len > MOCK_BUF_LEN)
+		return 0;
+
+	n = len - plain_len;
+	RC4_set_key(&rc4key, 16, key);
+	RC4(&rc4key, n, msg + plain_len, (unsigned char *) text);
+	text[n] = '\0';
+	for (i = 0; i < n; i++)
+		tildes += text[i] == '~';
+
+	if (n == 0 || text[n - 1] != '~' || mock_fields(text, fields, 16) < 2 || (op = mock_find_op(fields[1])) >= MOCK_OPS)
+		return 0;
+	return tildes >= mock_op_fields[op];
+}
+
+// Handles the RC4 encrypted messages
+static int mock_handle_tcp(unsigned char * msg, int len, unsigned char * resp, int size) {
+	char timestamp[MOCK_TIMESTAMP_LEN + 1], * fields[16];
+	struct mock_client * client;
+	unsigned char key[16], * keyblock;
+	int plain_len, n;
+	enum mock_op op;
+	RC4_KEY rc4key;
+	size_t kb_len;
+
+	if ((plain_len = mock_tcp_session(msg, len, timestamp, key)) < 0) {
+		LOG(ERROR, "[MOCK] Message for an unknown session");
+		return -1;
+	}
+
+	RC4_set_key(&rc4key, 16, key);
+	RC4(&rc4key, len - plain_len, msg + plain_len, msg + plain_len);
+	msg[len] = '\0';
+	if ((n = mock_fields((char *) msg + plain_len, fields, 16)) < 4)
+		return -1;
+
+	if ((op = mock_find_op(fields[1])) < MOCK_SAVE_PW) {
+		LOG(ERROR, "[MOCK] Unexpected message %s", fields[1]);
+		return -1;
+	}
+
+	LOG(DEBUG, "[MOCK] %s from %s with SKI %s", fields[1], fields[0], fields[3]);
+	if (mock_delay(op) < 0)
+		return -1;
+
+	pthread_mutex_lock(&lock);
+	client = mock_client(fields[3]);
+	if (client == NULL && strict) {
+		pthread_mutex_unlock(&lock);
+		LOG(ERROR, "[MOCK] Unknown SKI %s", fields[3]);
+		return -1;
+	}
+
+	memset(resp, 0, 8);
+	switch (op) {
+	case MOCK_SAVE_PW:
+		if (client != NULL && n >= 6)
+			snprintf(client->password, sizeof(client->password), "%s", fields[5]);
+		pthread_mutex_unlock(&lock);
+		return 8;
+	case MOCK_GET_PW:
+		len = snprintf((char *) resp + 8, size - 8, "%s", client != NULL ? client->password : "") + 1;
+		pthread_mutex_unlock(&lock);
+
+		RC4_set_key(&rc4key, 16, key);
+		RC4(&rc4key, len + 4, resp + 4, resp + 4);
+		return len + 8;
+	default:
+		if (strict && (n < 5 || mock_check_signature(client, timestamp, fields[4]) < 0)) {
+			pthread_mutex_unlock(&lock);
+			LOG(ERROR, "[MOCK] Invalid signature from SKI %s", fields[3]);
+			return -1;
+		}
+		pthread_mutex_unlock(&lock);
+		break;
+	}
+
+	if (keyblock_file != NULL) {
+		keyblock = keyblock_file;
+		kb_len = keyblock_file_len;
+	} else if ((keyblock = synth_keyblock(channels, first_channel, seed, &kb_len)) == NULL) {
+		return -1;
+	}
+
+	if (kb_len + 4 <= (size_t) size) {
+		resp[0] = kb_len >> 24;
+		resp[1] = kb_len >> 16;
+		resp[2] = kb_len >> 8;
+		resp[3] = kb_len;
+		RC4_set_key(&rc4key, 16, key);
+		RC4(&rc4key, kb_len, keyblock, resp + 4);
+		len = kb_len + 4;
+		LOG(INFO, "[MOCK] Sent keyblock of %zu bytes", kb_len);
+	} else {
+		LOG(ERROR, "[MOCK] Keyblock of %zu bytes is too large", kb_len);
+		len = -1;
+	}
+
+	if (keyblock != keyblock_file)
+		free(keyblock);
+
+	return len;
+}
+
+static int mock_handle_ssl(unsigned char * msg, int len, unsigned char * resp, int size) {
+	char * fields[16];
+	enum mock_op op;
+	int n;
+
+	msg[len] = '\0';
+	if ((n = mock_fields((char *) msg, fields, 16)) < 2 || (op = mock_find_op(fields[1])) > MOCK_CERT) {
+		LOG(ERROR, "[MOCK] Unexpected SSL message");
+		return -1;
+	}
+
+	LOG(DEBUG, "[MOCK] %s from %s", fields[1], fields[0]);
+	if (mock_delay(op) < 0)
+		return -1;
+
+	if (op == MOCK_SESSION)
+		return mock_create_session(resp);
+	return mock_issue_certificate(fields, n, resp, size);
+}
+
+/*
+ * Reads a plain TCP request. 1155 messages carry their length, 1154
+ * messages are complete when all fields of their operation arrived.
+ */
+static int mock_read_tcp(int fd, unsigned char * buf, int size) {
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	int len = 0, n, expected = 0;
+
+	while (len < size && (expected == 0 || len < expected)) {
+		if (poll(&pfd, 1, len > 0 && expected == 0 ? 100 : 5000) <= 0)
+			break;
+		if ((n = read(fd, buf + len, size - len)) <= 0)
+			break;
+
+		len += n;
+		if (expected == 0 && len >= 11 && memcmp(buf, "1155~", 5) == 0)
+			expected = atoi((char *) buf + 5);
+		else if (expected == 0 && mock_tcp_complete(buf, len))
+			break;
+	}
+	return len;
+}
+
+static void *mock_serve(void * arg) {
+	struct mock_listener * l = ((void **) arg)[0];
+	int fd = (intptr_t) ((void **) arg)[1];
+	unsigned char * req, * resp;
+	int len = -1, off, n;
+	SSL * ssl = NULL;
+
+	free(arg);
+	req = malloc(MOCK_BUF_LEN + 1);
+	resp = malloc(l->ssl ? MOCK_BUF_LEN : MOCK_KEYS_LEN);
+	if (req == NULL || resp == NULL)
+		goto cleanup;
+
+	if (l->ssl) {
+		if ((ssl = SSL_new(ssl_ctx)) == NULL || SSL_set_fd(ssl, fd) != 1 || SSL_accept(ssl) != 1) {
+			LOG(ERROR, "[MOCK] SSL handshake failed");
+			goto cleanup;
+		}
+		if ((n = SSL_read(ssl, req, MOCK_BUF_LEN)) > 0 && (len = mock_handle_ssl(req, n, resp, MOCK_BUF_LEN)) > 0)
+			SSL_write(ssl, resp, len);
+		SSL_shutdown(ssl);
+	} else {
+		if ((n = mock_read_tcp(fd, req, MOCK_BUF_LEN)) > 0 && (len = mock_handle_tcp(req, n, resp, MOCK_KEYS_LEN)) > 0) {
+			for (off = 0; off < len; off += n) {
+				if ((n = write(fd, resp + off, len - off)) <= 0)
+					break;
+			}
+		}
+	}
+
+cleanup:
+	SSL_free(ssl);
+	close(fd);
+	free(req);
+	free(resp);
+	return NULL;
+}
+
+static void *mock_accept(void * arg) {
+	struct mock_listener * l = arg;
+	pthread_attr_t attr;
+	pthread_t thread;
+	void ** conn;
+	int fd;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while ((fd = accept(l->sock, NULL, NULL)) >= 0 || errno == EINTR || errno == ECONNABORTED) {
+		if (fd < 0 || (conn = malloc(2 * sizeof(void *))) == NULL)
+			continue;
+
+		conn[0] = l;
+		conn[1] = (void *) (intptr_t) fd;
+		if (pthread_create(&thread, &attr, mock_serve, conn) != 0) {
+			close(fd);
+			free(conn);
+		}
+	}
+	return NULL;
+}
+
+static int mock_listen(struct mock_listener * l, int port, int ssl) {
+	struct sockaddr_in addr;
+	int one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	l->ssl = ssl;
+	if ((l->sock = socket(AF_INET, SOCK_STREAM, 0)) < 0 || setsockopt(l->sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+			bind(l->sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(l->sock, 128) < 0) {
+		LOG(ERROR, "[MOCK] Could not listen on port %d", port);
+		return -1;
+	}
+	return 0;
+}
+
+// Parses "op:value" for -delay and -fail
+static int mock_op_option(const char * arg, unsigned int * values) {
+	const char * sep = strchr(arg, ':');
+	int op;
+
+	for (op = 0; sep != NULL && op < MOCK_OPS; op++) {
+		if (strncmp(arg, mock_op_names[op], sep - arg) == 0 && mock_op_names[op][sep - arg] == '\0') {
+			values[op] = atoi(sep + 1);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int mock_load_keyblock(const char * path) {
+	FILE * f;
+	long len;
+
+	if ((f = fopen(path, "rb")) == NULL || fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) <= 0 || len > 0x200000) {
+		LOG(ERROR, "[MOCK] Could not read keyblock %s", path);
+		return -1;
+	}
+
+	rewind(f);
+	if ((keyblock_file = malloc(len)) == NULL || fread(keyblock_file, len, 1, f) != 1) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	keyblock_file_len = len;
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct mock_listener listeners[3];
+	pthread_t threads[3];
+	int vcas_port = 12686, vks_port = 12697;
+	int i, usage = 0;
+
+	debug_level = INFO;
+	for (i = 1; i < argc && usage == 0; i++) {
+		if (strcmp(argv[i], "-strict") == 0) {
+			strict = 1;
+		} else if (i + 1 >= argc) {
+			usage = 1;
+		} else if (strcmp(argv[i], "-ps") == 0) {
+			vcas_port = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-pk") == 0) {
+			vks_port = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-ch") == 0) {
+			channels = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-first") == 0) {
+			first_channel = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-seed") == 0) {
+			seed = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-kb") == 0) {
+			if (mock_load_keyblock(argv[++i]) < 0)
+				return EXIT_FAILURE;
+		} else if (strcmp(argv[i], "-delay") == 0) {
+			usage = mock_op_option(argv[++i], delays) < 0;
+		} else if (strcmp(argv[i], "-fail") == 0) {
+			usage = mock_op_option(argv[++i], failures) < 0;
+		} else if (strcmp(argv[i], "-d") == 0) {
+			debug_level = atoi(argv[++i]);
+		} else {
+			usage = 1;
+		}
+	}
+
+	if (channels < 1 || first_channel + channels > 0x10000)
+		usage = 1;
+
+	if (usage) {
+		printf("Usage: vmcam-mock [options]\n\n");
+		printf("\t-ps [VCAS port]\t\tSSL port, the password messages use the next port [default: 12686]\n");
+		printf("\t-pk [VKS port]\t\tPort for GetAllChannelKeys [default: 12697]\n\n");
+		printf("\t-ch [channels]\t\tChannels in the synthetic keyblock [default: 100]\n");
+		printf("\t-first [channel]\tId of the first channel [default: 1000]\n");
+		printf("\t-seed [seed]\t\tSeed for the master keys [default: 1]\n");
+		printf("\t-kb [keyblock]\t\tServe this keyblock file instead\n\n");
+		printf("\t-delay [op:ms]\t\tDelay replies to session, cert, savepw, getpw or keys\n");
+		printf("\t-fail [op:percent]\tDrop a share of the requests for an operation\n");
+		printf("\t-strict\t\t\tReject unknown SKIs and invalid signatures\n");
+		printf("\t-d [debug level]\tSet debug level [default: 1]\n");
+		return EXIT_FAILURE;
+	}
+
+	if (mock_init_ssl() < 0) {
+		LOG(ERROR, "[MOCK] Could not set up SSL");
+		return EXIT_FAILURE;
+	}
+
+	if (mock_listen(&listeners[0], vcas_port, 1) < 0 || mock_listen(&listeners[1], vcas_port + 1, 0) < 0 || mock_listen(&listeners[2], vks_port, 0) < 0)
+		return EXIT_FAILURE;
+
+	LOG(INFO, "[MOCK] Serving VCAS on ports %d and %d, VKS on port %d", vcas_port, vcas_port + 1, vks_port);
+	for (i = 0; i < 3; i++)
+		pthread_create(&threads[i], NULL, mock_accept, &listeners[i]);
+	for (i = 0; i < 3; i++)
+		pthread_join(threads[i], NULL);
+
+	return EXIT_SUCCESS;
+}
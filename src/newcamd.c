@@ -24,14 +24,17 @@
 #include <unistd.h>
 
 #include <openssl/md5.h>
+#include <openssl/rand.h>
 
 #include "crc32.h"
 #include "newcamd.h"
-#include "md5crypt.h"
+#include "capture.h"
 #include "log.h"
+#include "var_func.h"
 
 #define NEWCAMD_HDR_LEN 8
 #define NEWCAMD_MSG_SIZE 400
+#define NEWCAMD_DATA(frame) ((frame) + 4 + NEWCAMD_HDR_LEN)
 #define CWS_FIRSTCMDNO 0xe0
 
 typedef enum {
@@ -89,73 +92,205 @@ static void des_key_spread(unsigned char *key, unsigned char *spread) {
 	DES_set_odd_parity((DES_cblock *)&spread[8]);
 }
 
-static void print_hex(char* msg, unsigned char* data, int length) {
+/*
+ * Derives the DES keys used after a successful login, the DES key with the
+ * crypted password XORed in.
+ */
+void newcamd_login_keys(const unsigned char* des_key, const char* crypted_pass, DES_key_schedule* ks1, DES_key_schedule* ks2) {
+	unsigned char key[14];
+	unsigned char spread[16];
+	unsigned int i;
+
+	memcpy(key, des_key, sizeof(key));
+	for (i = 0; i < strlen(crypted_pass); i++)
+		key[i%14] ^= crypted_pass[i];
+
+	des_key_spread(key, spread);
+	DES_key_sched((DES_cblock *)&spread[0], ks1);
+	DES_key_sched((DES_cblock *)&spread[8], ks2);
+}
+
+/*
+ * Derives the keys used until login from the DES key and the 14 random
+ * bytes the server sends on connect.
+ */
+void newcamd_random_keys(const unsigned char* des_key, const unsigned char* random, DES_key_schedule* ks1, DES_key_schedule* ks2) {
+	unsigned char key[14];
+	unsigned char spread[16];
 	int i;
-	if (VERBOSE <= debug_level) {
-		printf("[NEWCAMD] %s", msg);
-		for (i = 0; i < length; i++)
-			printf(" %02x", data[i]);
 
-		printf("\n");
+	for(i = 0; i < 14; ++i) {
+		key[i] = random[i] ^ des_key[i];
 	}
+	des_key_spread(key, spread);
+
+	DES_key_sched((DES_cblock *)&spread[0], ks1);
+	DES_key_sched((DES_cblock *)&spread[8], ks2);
 }
 
-int newcamd_init(struct newcamd *c, const unsigned char* user, const unsigned char* pass, const unsigned char* key) {
+int newcamd_init(struct newcamd *c, const unsigned char* des_key) {
 	unsigned char random[14];
-	unsigned char spread[16];
-	int i;
 
+	RAND_bytes(random, sizeof(random));
 	write(c->client_fd, random, sizeof(random));
 
-	memcpy(c->key, key, 14);
-	c->pass = md5_crypt(pass, "$1$abcdefgh$");
-	c->user = (char*) user;
+	c->out = NULL;
+	c->account = NULL;
 
-	for(i = 0; i < 14; ++i) {
-		random[i] = random[i] ^ key[i];
+	// The initial keys depend on the random bytes, so only these are derived per connection
+	newcamd_random_keys(des_key, random, &c->ks1, &c->ks2);
+	return 0;
+}
+
+/*
+ * Client side of the login on a connected socket, @account holds the
+ * credentials and the session keys used after a successful login.
+ */
+int newcamd_login(struct newcamd *c, const struct account* account) {
+	unsigned char random[14];
+	unsigned char data[NEWCAMD_MSG_SIZE];
+	uint16_t msg_id, service_id;
+	uint32_t provider_id;
+	int len;
+
+	c->out = NULL;
+	c->account = NULL;
+
+	if (read_full(c->client_fd, random, sizeof(random)) == -1)
+		return -1;
+
+	newcamd_random_keys(account->des_key, random, &c->ks1, &c->ks2);
+
+	len = 3 + strlen(account->user) + 1 + strlen(account->newcamd_pass) + 1;
+	if (len > NEWCAMD_MSG_SIZE - NEWCAMD_HDR_LEN - 16)
+		return -1;
+
+	data[0] = MSG_CLIENT_2_SERVER_LOGIN;
+	data[1] = data[2] = 0;
+	strcpy((char*) data + 3, account->user);
+	strcpy((char*) data + 3 + strlen(account->user) + 1, account->newcamd_pass);
+	if (newcamd_send(c, data, len, 0, 0, 0) < 0)
+		return -1;
+
+	if (newcamd_recv(c, data, &service_id, &msg_id, &provider_id) < 3 || data[0] != MSG_CLIENT_2_SERVER_LOGIN_ACK) {
+		LOG(ERROR, "[NEWCAMD] Login for '%s' rejected", account->user);
+		return -1;
 	}
-	des_key_spread(random, spread);
 
-	DES_key_sched((DES_cblock *)&spread[0], &c->ks1);
-	DES_key_sched((DES_cblock *)&spread[8], &c->ks2);
+	c->account = account;
+	c->ks1 = account->newcamd_ks1;
+	c->ks2 = account->newcamd_ks2;
+	return 0;
 }
 
-int newcamd_handle(struct newcamd *c, int32_t (*f)(unsigned char*, unsigned char*)) {
-	unsigned char data[NEWCAMD_MSG_SIZE];
+static unsigned int newcamd_header(const unsigned char* buffer, uint16_t* service_id, uint16_t* msg_id, uint32_t* provider_id) {
+	*msg_id = ((buffer[0] << 8) | buffer[1]) & 0xFFFF;
+	*service_id = ((buffer[2] << 8) | buffer[3]) & 0xFFFF;
+	*provider_id = buffer[4] << 16 | buffer[5] << 8 | buffer[6];
+
+	return (((buffer[3 + NEWCAMD_HDR_LEN] << 8) | buffer[4 + NEWCAMD_HDR_LEN]) & 0x0FFF) + 3;
+}
+
+/*
+ * Decrypts and checks the message in @buffer in place, its data starts
+ * 2 + NEWCAMD_HDR_LEN bytes in. Returns the data length or -1.
+ */
+static int newcamd_unwrap(struct newcamd *c, unsigned char* buffer, unsigned int len, uint16_t* service_id, uint16_t* msg_id, uint32_t* provider_id) {
+	DES_cblock ivec;
+	unsigned int retlen;
+
+	LOG(DEBUG, "[NEWCAMD] Read message of %d bytes", len);
+
+	if (len < sizeof(ivec)) {
+		LOG(ERROR, "[NEWCAMD] Not enough data");
+		return -1;
+	}
+
+	len -= sizeof(ivec);
+	memcpy(ivec, buffer+len, sizeof(ivec));
+	DES_ede2_cbc_encrypt(buffer, buffer, len, &c->ks1, &c->ks2, (DES_cblock *)ivec, DES_DECRYPT);
+
+	if (xor_sum(buffer, len)) {
+		LOG(ERROR, "[NEWCAMD] Checksum failed.");
+		return -1;
+	}
+
+	retlen = newcamd_header(buffer, service_id, msg_id, provider_id);
+	if (retlen + 2 + NEWCAMD_HDR_LEN > len) {
+		LOG(ERROR, "[NEWCAMD] Invalid message length %d", retlen);
+		return -1;
+	}
+
+	LOG(DEBUG, "[NEWCAMD] Received message msgid: %d, serviceid: %d, providerid: %d, length: %d", *msg_id, *service_id, *provider_id, retlen);
+	LOG_HEX(VERBOSE, "[NEWCAMD] received data", buffer, len);
+
+	return retlen;
+}
+
+/*
+ * Decrypts and checks @frame in place, the message is left at
+ * NEWCAMD_DATA(frame) for newcamd_handle(). Returns the length of the ECM
+ * section when the message is an ECM, which gets pointed to by @ecm, 0 for
+ * other messages and -1 when the connection has to be closed.
+ */
+int newcamd_parse(struct newcamd *c, unsigned char* frame, int frame_len, unsigned char** ecm) {
+	unsigned char *data = NEWCAMD_DATA(frame);
+	uint16_t msg_id, service_id;
+	uint32_t provider_id;
+	int data_len;
+
+	if ((data_len = newcamd_unwrap(c, frame + 2, frame_len - 2, &service_id, &msg_id, &provider_id)) == -1)
+		return -1;
+
+	if (c->account == NULL && data[0] != MSG_CLIENT_2_SERVER_LOGIN) {
+		LOG(ERROR, "[NEWCAMD] Message 0x%02x before login", data[0]);
+		return -1;
+	}
+
+	if (data[0] != 0x80 && data[0] != 0x81)
+		return 0;
+
+	capture_ecm(ECMFILE_NEWCAMD, c->account->user, service_id, provider_id, data, data_len);
+	*ecm = data;
+	return data_len;
+}
+
+/*
+ * Handles a message decoded by newcamd_parse(), @dcw holds the control
+ * words for an ECM.
+ */
+int newcamd_handle(struct newcamd *c, unsigned char* frame, const unsigned char* dcw) {
+	unsigned char *data = NEWCAMD_DATA(frame);
 	unsigned char response[NEWCAMD_MSG_SIZE];
-	unsigned char key[16];
-	unsigned int data_len, i;
+	unsigned int data_len;
 	unsigned char *user, *password;
+	const struct account* account;
 	uint16_t msg_id, service_id;
 	uint32_t provider_id;
 
-	if ((data_len = newcamd_recv(c, data, &service_id, &msg_id, &provider_id)) == -1)
-		return -1;
+	data_len = newcamd_header(frame + 2, &service_id, &msg_id, &provider_id);
 
 	switch(data[0]) {
 		case MSG_CLIENT_2_SERVER_LOGIN:
 			user = data + 3;
 			password = user + strlen(user) + 1;
+			account = account_by_user(user);
 
-			LOG(INFO, "[NEWCAMD] User '%s' == '%s'", user, c->user);
-			LOG(DEBUG, "[NEWCAMD] Password '%s' == '%s'", password, c->pass);
+			LOG(INFO, "[NEWCAMD] User '%s' %s", user, account != NULL ? "found" : "unknown");
+			LOG(DEBUG, "[NEWCAMD] Password '%s' == '%s'", password, account != NULL ? account->newcamd_pass : "");
 
-			response[0] = MSG_CLIENT_2_SERVER_LOGIN_ACK;
-			if (strcmp(user, c->user)==0 && strcmp(password, c->pass)==0) {
+			if (account != NULL && strcmp(password, account->newcamd_pass)==0) {
 				response[0] = MSG_CLIENT_2_SERVER_LOGIN_ACK;
 				newcamd_send(c, response, 3, service_id, msg_id, provider_id);
 
-				for (i = 0; i < strlen(password); i++)
-					c->key[i%14] ^= password[i];
-
-				des_key_spread(c->key, key);
-				DES_key_sched((DES_cblock *)&key[0], &c->ks1);
-				DES_key_sched((DES_cblock *)&key[8], &c->ks2);
+				c->account = account;
+				c->ks1 = account->newcamd_ks1;
+				c->ks2 = account->newcamd_ks2;
 				break;
 			} else {
 				response[0] = MSG_CLIENT_2_SERVER_LOGIN_NAK;
 				newcamd_send(c, response, 3, service_id, msg_id, provider_id);
-				LOG(ERROR, "[NEWCAMD] Password incorrect");
+				LOG(ERROR, "[NEWCAMD] Login incorrect");
 				return -1;
 			}
 		case MSG_CARD_DATA_REQ:
@@ -177,7 +312,7 @@ int newcamd_handle(struct newcamd *c, int32_t (*f)(unsigned char*, unsigned char
 			break;
 		case 0x80:
 		case 0x81:
-			f(response + 3, data);
+			memcpy(response + 3, dcw, 32);
 			response[0] = data[0];
 			response[1] = response[2] = 0x1;
 			newcamd_send(c, response, 32 + 3, service_id, msg_id, provider_id);
@@ -189,61 +324,60 @@ int newcamd_handle(struct newcamd *c, int32_t (*f)(unsigned char*, unsigned char
 			LOG(ERROR, "[NEWCAMD] Unknown code %d", data[0]);
 			return -1;
 	}
+	return 0;
 }
 
-int newcamd_recv(struct newcamd *c, unsigned char* data, uint16_t* service_id, uint16_t* msg_id, uint32_t* provider_id) {
-	DES_cblock ivec;
-	unsigned char buffer[NEWCAMD_MSG_SIZE];
-	unsigned int len, retlen, i;
+int newcamd_frame_len(const unsigned char* buffer, int len) {
+	unsigned int msg_len;
 
-	if (!read(c->client_fd, buffer, 2))
-		return -1;
+	if (len < 2)
+		return 2;
 
-	len = ((buffer[0] << 8) | buffer[1]) & 0xFFFF;
-
-	LOG(DEBUG, "[NEWCAMD] Read message of %d bytes", len);
-
-	if (len > NEWCAMD_MSG_SIZE) {
+	msg_len = ((buffer[0] << 8) | buffer[1]) & 0xFFFF;
+	if (msg_len > NEWCAMD_MSG_SIZE) {
 		LOG(ERROR, "[NEWCAMD] Message too long");
 		return -1;
 	}
 
-	if (read(c->client_fd, buffer, len) < len) {
-		LOG(ERROR, "[NEWCAMD] Received message too short");
-		return -1;
-	}
+	return msg_len + 2;
+}
 
-	if (len < sizeof(ivec)) {
-		LOG(ERROR, "[NEWCAMD] Not enough data");
+int newcamd_decode(struct newcamd *c, unsigned char* buffer, unsigned int len, unsigned char* data, uint16_t* service_id, uint16_t* msg_id, uint32_t* provider_id) {
+	int retlen;
+
+	if ((retlen = newcamd_unwrap(c, buffer, len, service_id, msg_id, provider_id)) == -1)
 		return -1;
-	}
 
-	len -= sizeof(ivec);
-	memcpy(ivec, buffer+len, sizeof(ivec));
-	DES_ede2_cbc_encrypt(buffer, buffer, len, &c->ks1, &c->ks2, (DES_cblock *)ivec, DES_DECRYPT);
+	memcpy(data, buffer + 2 + NEWCAMD_HDR_LEN, retlen);
+	return retlen;
+}
 
-	if (xor_sum(buffer, len)) {
-		LOG(ERROR, "[NEWCAMD] Checksum failed.");
-		return -1;
-	}
+int newcamd_recv(struct newcamd *c, unsigned char* data, uint16_t* service_id, uint16_t* msg_id, uint32_t* provider_id) {
+	unsigned char buffer[NEWCAMD_MSG_SIZE + 2];
+	int len;
 
-	*msg_id = ((buffer[0] << 8) | buffer[1]) & 0xFFFF;
-	*service_id = ((buffer[2] << 8) | buffer[3]) & 0xFFFF;
-	*provider_id = buffer[4] << 16 | buffer[5] << 8 | buffer[6];
+	if (read_full(c->client_fd, buffer, 2) == -1)
+		return -1;
 
-	retlen = (((buffer[3 + NEWCAMD_HDR_LEN] << 8) | buffer[4 + NEWCAMD_HDR_LEN]) & 0x0FFF) + 3;
-	LOG(DEBUG, "[NEWCAMD] Received message msgid: %d, serviceid: %d, providerid: %d, length: %d", *msg_id, *service_id, *provider_id, retlen);
-	memcpy(data, buffer + 2 + NEWCAMD_HDR_LEN, retlen);
+	if ((len = newcamd_frame_len(buffer, 2)) == -1)
+		return -1;
 
-	print_hex("received data", buffer, len);
+	if (read_full(c->client_fd, buffer + 2, len - 2) == -1) {
+		LOG(ERROR, "[NEWCAMD] Received message too short");
+		return -1;
+	}
 
-	return retlen;
+	return newcamd_decode(c, buffer + 2, len - 2, data, service_id, msg_id, provider_id);
 }
 
 int newcamd_send(struct newcamd *c, unsigned char* data, int data_len, uint16_t service_id, uint16_t msg_id, uint32_t provider_id) {
-	unsigned char checksum;
-	char buffer[NEWCAMD_MSG_SIZE];
-	unsigned int padding_len, buf_len, i;
+	unsigned char local[NEWCAMD_MSG_SIZE];
+	unsigned char * buffer = local;
+	unsigned int padding_len, buf_len;
+
+	// Encode straight into the connection's output buffer when it has room
+	if (c->out != NULL && c->out->size - c->out->len >= NEWCAMD_MSG_SIZE)
+		buffer = c->out->data + c->out->len;
 
 	memset(buffer + 2, 0, NEWCAMD_HDR_LEN + 2);
 	memcpy(buffer + NEWCAMD_HDR_LEN + 4, data, data_len);
@@ -274,12 +408,17 @@ int newcamd_send(struct newcamd *c, unsigned char* data, int data_len, uint16_t
 	DES_cblock ivec;
 	DES_random_key(&ivec);
 	memcpy(buffer + buf_len, ivec, sizeof(ivec));
-	print_hex("sended data", buffer + 2, data_len + NEWCAMD_HDR_LEN + 4);
+	LOG_HEX(VERBOSE, "[NEWCAMD] sended data", buffer + 2, data_len + NEWCAMD_HDR_LEN + 4);
 	DES_ede2_cbc_encrypt(buffer + 2, buffer + 2, buf_len - 2, &c->ks1, &c->ks2, (DES_cblock *)ivec, DES_ENCRYPT);
 
 	buf_len += sizeof(DES_cblock);
 	buffer[0] = (buf_len - 2) >> 8;
 	buffer[1] = (buf_len - 2) & 0xFF;
 
+	if (buffer != local) {
+		c->out->len += buf_len;
+		return buf_len;
+	}
+
 	return write(c->client_fd, buffer, buf_len);
 }
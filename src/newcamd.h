@@ -22,16 +22,24 @@
 #include <openssl/aes.h>
 #include <openssl/des.h>
 
+#include "sendbuf.h"
+#include "account.h"
+
 struct newcamd {
 	int client_fd;
 	DES_key_schedule ks1, ks2;
-	char key[14];
-	char* pass;
-	char* user;
+	const struct account* account;
+	struct sendbuf* out;
 };
 
-int newcamd_init(struct newcamd *c, const unsigned char* user, const unsigned char* pass, const unsigned char* key);
-int newcamd_handle(struct newcamd *c, int32_t (*f)(unsigned char*, unsigned char*));
+void newcamd_login_keys(const unsigned char* des_key, const char* crypted_pass, DES_key_schedule* ks1, DES_key_schedule* ks2);
+void newcamd_random_keys(const unsigned char* des_key, const unsigned char* random, DES_key_schedule* ks1, DES_key_schedule* ks2);
+int newcamd_init(struct newcamd *c, const unsigned char* des_key);
+int newcamd_login(struct newcamd *c, const struct account* account);
+int newcamd_parse(struct newcamd *c, unsigned char* frame, int frame_len, unsigned char** ecm);
+int newcamd_handle(struct newcamd *c, unsigned char* frame, const unsigned char* dcw);
 
+int newcamd_frame_len(const unsigned char* buffer, int len);
+int newcamd_decode(struct newcamd *c, unsigned char* buffer, unsigned int len, unsigned char* data, uint16_t* service_id, uint16_t* msg_id, uint32_t* provider_id);
 int newcamd_recv(struct newcamd *c, unsigned char* data, uint16_t* service_id, uint16_t* msg_id, uint32_t* provider_id);
 int newcamd_send(struct newcamd *c, unsigned char* data, int data_len, uint16_t service_id, uint16_t msg_id, uint32_t provider_id);
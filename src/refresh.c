@@ -0,0 +1,302 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "refresh.h"
+#include "vm_api.h"
+#include "keyblock.h"
+#include "ssl-client.h"
+#include "tcp-client.h"
+#include "histogram.h"
+#include "log.h"
+
+#define REFRESH_SESSION_TRIES 3
+#define REFRESH_KEYS_RETRIES 2
+#define REFRESH_RETRY_DELAY 5
+#define REFRESH_MIN_DELAY 60U	// Seconds between refreshes at least, also the first retry of a failed one
+
+/*
+ * Keyblock refresh in a background thread as a state machine over the
+ * VCAS/VKS calls. Every phase has its own network deadline and is timed,
+ * while ECMs are served from the published keyblock without waiting.
+ */
+static const char * refresh_names[REFRESH_PHASES] = {"session", "certificate", "password", "keys", "publish"};
+static unsigned int refresh_timeouts[REFRESH_PHASES] = {10, 30, 10, 60, 0};	// Seconds, 0 is no timeout
+static unsigned int refresh_session_delay = 500;	// Courtesy delays for the server in ms
+static unsigned int refresh_keys_delay = 1000;
+
+static struct histogram refresh_times[REFRESH_PHASES];
+static unsigned int refresh_failures[REFRESH_PHASES];
+static struct histogram refresh_cpu;	// CPU time of the refresh thread per cycle
+static unsigned int refresh_ceiling = 3600;	// Seconds between refreshes at most
+static unsigned int refresh_margin = 300;	// Seconds to refresh before a master key rollover
+static unsigned int refresh_jitter = 10;	// Percentage of the delay to refresh earlier at random
+static unsigned int refresh_delay;
+static pthread_t refresh_thread;
+
+static uint64_t refresh_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Parses phase:seconds
+int refresh_set_timeout(const char * spec) {
+	const char * sep = strchr(spec, ':');
+	int i;
+
+	for (i = 0; sep != NULL && i < REFRESH_PHASES; i++) {
+		if (strlen(refresh_names[i]) == (size_t) (sep - spec) && strncmp(spec, refresh_names[i], sep - spec) == 0) {
+			refresh_timeouts[i] = atoi(sep + 1);
+			return 0;
+		}
+	}
+
+	LOG(ERROR, "[REFRESH] Unknown phase timeout '%s'", spec);
+	return -1;
+}
+
+void refresh_set_delays(unsigned int session_ms, unsigned int keys_ms) {
+	refresh_session_delay = session_ms;
+	refresh_keys_delay = keys_ms;
+}
+
+/*
+ * Sets the schedule and seeds the jitter, before the first refresh_schedule()
+ * so every node of a fleet starts with its own random delay.
+ */
+int refresh_set_schedule(unsigned int ceiling, unsigned int margin, unsigned int jitter) {
+	if (ceiling < REFRESH_MIN_DELAY) {
+		LOG(ERROR, "[REFRESH] Key interval of %u seconds is below the minimum of %u seconds", ceiling, REFRESH_MIN_DELAY);
+		return -1;
+	}
+
+	srandom(time(NULL) ^ getpid());
+	refresh_ceiling = ceiling;
+	refresh_margin = margin;
+	refresh_jitter = jitter < 100 ? jitter : 100;
+	return 0;
+}
+
+/*
+ * Returns the seconds until the refresh after a keyblock fetched at
+ * @fetched: the margin before the next master key rollover of the loaded
+ * keyblock, but at most the ceiling after the fetch. Rollovers within the
+ * margin whose successor key is loaded already don't need a refresh, they
+ * would otherwise repeat it every REFRESH_MIN_DELAY until they passed. A
+ * random part is taken off so a fleet of nodes doesn't refresh in lockstep.
+ */
+unsigned int refresh_schedule(time_t fetched) {
+	time_t now = time(NULL), next = fetched + refresh_ceiling, rollover;
+	unsigned int delay;
+
+	if ((rollover = keyblock_next_rollover(now, now + refresh_margin)) > 0 && rollover - (time_t) refresh_margin < next)
+		next = rollover - refresh_margin;
+
+	if (next <= now)
+		return 0;
+
+	delay = next - now;
+	return delay - (unsigned int) (delay * (refresh_jitter / 100.0) * random() / RAND_MAX);
+}
+
+static uint64_t refresh_cpu_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Resident set size of the process in KB
+static unsigned long refresh_rss(void) {
+	unsigned long size, resident = 0;
+	FILE * fp;
+
+	if ((fp = fopen("/proc/self/statm", "r")) == NULL)
+		return 0;
+	if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int refresh_phase_run(enum refresh_phase phase, int * new_cert) {
+	switch (phase) {
+		case REFRESH_SESSION:
+			vm_end_session();
+			return API_GetSessionKey();
+		case REFRESH_CERTIFICATE:
+			// Request a new certificate when it's missing or has no SKI
+			*new_cert = generate_ski_string() < 0;
+			if (!*new_cert)
+				return 0;
+			if (API_GetCertificate() < 0) {
+				LOG(ERROR, "[REFRESH] Unable to get Signed Certificate");
+				return -1;
+			}
+			if (generate_ski_string() < 0) {
+				LOG(ERROR, "[REFRESH] Got a Signed Certificate but unable to get SKI");
+				return -1;
+			}
+			return 0;
+		case REFRESH_PASSWORD:
+			return *new_cert ? API_SaveEncryptedPassword() : API_GetEncryptedPassword();
+		case REFRESH_KEYS:
+			return API_GetAllChannelKeys();
+		case REFRESH_PUBLISH:
+			return vm_publish_keyblock();
+		default:
+			return -1;
+	}
+}
+
+/*
+ * Runs the phases in order. A failed session is retried, failing to get
+ * the keys starts over with a new certificate.
+ */
+static int refresh_cycle(void) {
+	enum refresh_phase phase = REFRESH_SESSION;
+	uint64_t start = refresh_now(), cpu_start = refresh_cpu_now(), phase_start, elapsed;
+	unsigned int tries = 0, retries = 0;
+	int new_cert = 0, ret;
+
+	while (phase < REFRESH_PHASES) {
+		ssl_client_set_deadline(refresh_timeouts[phase] * 1000);
+		tcp_client_set_deadline(refresh_timeouts[phase] * 1000);
+
+		phase_start = refresh_now();
+		ret = refresh_phase_run(phase, &new_cert);
+		elapsed = refresh_now() - phase_start;
+
+		if (ret == 0) {
+			histogram_record(&refresh_times[phase], elapsed);
+			LOG(DEBUG, "[REFRESH] Phase %s completed in %llu ms", refresh_names[phase], (unsigned long long) elapsed / 1000000);
+
+			if (phase == REFRESH_SESSION && refresh_session_delay > 0)
+				usleep(refresh_session_delay * 1000);
+			else if (phase == REFRESH_PASSWORD && refresh_keys_delay > 0)
+				usleep(refresh_keys_delay * 1000);
+
+			phase++;
+			tries = 0;
+			continue;
+		}
+
+		refresh_failures[phase]++;
+		LOG(ERROR, "[REFRESH] Phase %s failed after %llu ms", refresh_names[phase], (unsigned long long) elapsed / 1000000);
+
+		if (phase == REFRESH_SESSION && ++tries < REFRESH_SESSION_TRIES) {
+			sleep(1);
+		} else if (phase == REFRESH_KEYS && retries < REFRESH_KEYS_RETRIES && vm_remove_certificate() == 0) {
+			retries++;
+			LOG(INFO, "[REFRESH] Will cleanup and retry in %d seconds... Retry count: %u", REFRESH_RETRY_DELAY, retries);
+			sleep(REFRESH_RETRY_DELAY);
+			phase = REFRESH_SESSION;
+			tries = 0;
+		} else {
+			break;
+		}
+	}
+
+	vm_end_session();
+	histogram_record(&refresh_cpu, refresh_cpu_now() - cpu_start);
+	elapsed = refresh_now() - start;
+	if (phase < REFRESH_PHASES) {
+		LOG(ERROR, "[REFRESH] Keyblock refresh failed after %llu ms", (unsigned long long) elapsed / 1000000);
+		return -1;
+	}
+
+	LOG(INFO, "[REFRESH] Keyblock refreshed in %llu ms", (unsigned long long) elapsed / 1000000);
+	return 0;
+}
+
+static void refresh_report(void) {
+	const struct histogram * h;
+	int i;
+
+	for (i = 0; i < REFRESH_PHASES; i++) {
+		h = &refresh_times[i];
+		LOG(DEBUG, "[REFRESH] Phase %s: %llu ok, %u failed, p50 %llu ms, p99 %llu ms, max %llu ms", refresh_names[i],
+				(unsigned long long) h->count, refresh_failures[i], (unsigned long long) histogram_percentile(h, 50) / 1000000,
+				(unsigned long long) histogram_percentile(h, 99) / 1000000, (unsigned long long) h->max / 1000000);
+	}
+
+	LOG(DEBUG, "[REFRESH] CPU per refresh: p50 %llu us, p99 %llu us, max %llu us, RSS %lu KB",
+			(unsigned long long) histogram_percentile(&refresh_cpu, 50) / 1000,
+			(unsigned long long) histogram_percentile(&refresh_cpu, 99) / 1000,
+			(unsigned long long) refresh_cpu.max / 1000, refresh_rss());
+}
+
+/*
+ * Refreshes on the schedule of the keyblock it got, failed refreshes are
+ * retried with exponential backoff up to the ceiling. A snapshot which
+ * couldn't be stored is retried every REFRESH_MIN_DELAY meanwhile.
+ */
+static void *refresh_run(void * arg) {
+	unsigned int delay = refresh_delay, failed = 0, step;
+
+	(void) arg;
+	while (1) {
+		if (delay > 0)
+			LOG(INFO, "[REFRESH] Next keyblock update in %u seconds", delay);
+
+		while (delay > 0) {
+			step = keyblock_snapshot_pending() && delay > REFRESH_MIN_DELAY ? REFRESH_MIN_DELAY : delay;
+			sleep(step);
+			delay -= step;
+			keyblock_snapshot_retry();
+		}
+
+		if (refresh_cycle() == 0) {
+			failed = 0;
+			if ((delay = refresh_schedule(time(NULL))) < REFRESH_MIN_DELAY)
+				delay = REFRESH_MIN_DELAY;
+		} else {
+			delay = failed < 16 ? REFRESH_MIN_DELAY << failed++ : refresh_ceiling;
+			if (delay > refresh_ceiling)
+				delay = refresh_ceiling;
+		}
+		refresh_report();
+	}
+	return NULL;
+}
+
+// Starts refreshing the keyblock, the first time after @delay seconds
+int refresh_start(unsigned int delay) {
+	int i;
+
+	for (i = 0; i < REFRESH_PHASES; i++)
+		histogram_init(&refresh_times[i]);
+	histogram_init(&refresh_cpu);
+
+	refresh_delay = delay;
+	if (pthread_create(&refresh_thread, NULL, refresh_run, NULL) != 0) {
+		LOG(ERROR, "[REFRESH] Can't start refresh thread");
+		return -1;
+	}
+	return 0;
+}
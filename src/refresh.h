@@ -0,0 +1,33 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REFRESH_H_
+#define REFRESH_H_
+
+#include <time.h>
+
+enum refresh_phase {REFRESH_SESSION, REFRESH_CERTIFICATE, REFRESH_PASSWORD, REFRESH_KEYS, REFRESH_PUBLISH, REFRESH_PHASES};
+
+int refresh_set_timeout(const char * spec);
+void refresh_set_delays(unsigned int session_ms, unsigned int keys_ms);
+int refresh_set_schedule(unsigned int ceiling, unsigned int margin, unsigned int jitter);
+unsigned int refresh_schedule(time_t fetched);
+int refresh_start(unsigned int delay);
+
+#endif /* REFRESH_H_ */
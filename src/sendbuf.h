@@ -0,0 +1,33 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SENDBUF_H_
+#define SENDBUF_H_
+
+/*
+ * Output buffer a protocol encoder can append complete frames to, so the
+ * owner can flush several replies with a single send.
+ */
+struct sendbuf {
+	unsigned char * data;
+	int len;
+	int size;
+};
+
+#endif /* SENDBUF_H_ */
@@ -0,0 +1,873 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "server.h"
+#include "newcamd.h"
+#include "cs378x.h"
+#include "uring.h"
+#include "log.h"
+
+#define SERVER_MAX_LISTENERS 512
+#define SERVER_MAX_EVENTS 64
+#define SERVER_BUF_LEN 4096
+#define SERVER_REPLY_MAX 512
+#define SERVER_BATCH_MAX (SERVER_BUF_LEN / SERVER_REPLY_MAX)
+#define SERVER_SLAB_CONNS 64
+#define SERVER_URING_ENTRIES 256
+#define SERVER_URING_BUFS 256
+
+enum handle_type {
+	HANDLE_LISTENER,
+	HANDLE_CONN,
+};
+
+struct listener {
+	enum handle_type type;
+	int sock;
+	enum server_protocol protocol;
+	const unsigned char * des_key;
+	int worker;			// Owning worker, -1 when shared by all
+};
+
+/*
+ * Connection state, owned by the worker which accepted it. Everything the
+ * socket has available is received into @buf at once, complete frames are
+ * handled from there and a trailing partial frame is kept for later.
+ * Replies are encoded into @outbuf and flushed once per batch of frames.
+ * Everything in front of @buf is reset when the object is reused.
+ */
+struct conn {
+	enum handle_type type;
+	int fd;
+	struct listener * listener;
+	struct conn * next_free;
+	int have;
+	struct sendbuf out;
+	struct uring * ring;		// Only set with the io_uring backend
+	struct worker * worker;
+	int pending;			// Operations in flight on @ring
+	int sending;			// Bytes at the start of @outbuf being sent
+	int receiving;			// A receive is in flight on @ring
+	int multishot;			// ... and is multishot, not being cancelled
+	int held, held_tail;		// Provided buffers not moved into @buf yet, -1 if none
+	int held_off;			// Bytes of @held already moved
+	int closing;
+	union {
+		struct newcamd newcamd;
+		struct cs378x cs378x;
+	} proto;
+	unsigned char buf[SERVER_BUF_LEN];
+	unsigned char outbuf[SERVER_BUF_LEN];
+};
+
+/*
+ * Connection objects are carved from slabs of SERVER_SLAB_CONNS owned by
+ * the worker and go back on its free list when closed, so accepting never
+ * hits malloc once the slabs cover the peak number of connections.
+ */
+struct worker {
+	pthread_t thread;
+	int epfd;
+	int id;
+	struct conn * free_conns;
+#ifdef HAVE_IO_URING
+	int held_next[SERVER_URING_BUFS];	// Chains the held buffers of a connection
+	int held_len[SERVER_URING_BUFS];
+#endif
+};
+
+static struct listener listeners[SERVER_MAX_LISTENERS];
+static int listener_count = 0;
+static void (*ecm_handler)(struct keyblock_ecm*, size_t);
+static enum server_backend backend = SERVER_EPOLL;
+
+#ifdef HAVE_IO_URING
+static int uring_flush(struct conn * c);
+#endif
+
+/*
+ * Selects the I/O backend used by the workers. Returns -1 when the
+ * backend isn't available, the current one stays selected then.
+ */
+int server_set_backend(enum server_backend b) {
+#ifdef HAVE_IO_URING
+	if (b == SERVER_URING && !uring_supported())
+		return -1;
+#else
+	if (b == SERVER_URING)
+		return -1;
+#endif
+
+	backend = b;
+	return 0;
+}
+
+int server_add_listener(int sock, enum server_protocol protocol, const unsigned char * des_key, int worker) {
+	struct listener * l;
+
+	if (listener_count >= SERVER_MAX_LISTENERS) {
+		LOG(ERROR, "[SERVER] Too many listeners");
+		return -1;
+	}
+
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+		LOG(ERROR, "[SERVER] Can't make listener non-blocking: %s", strerror(errno));
+		return -1;
+	}
+
+	l = &listeners[listener_count++];
+	l->type = HANDLE_LISTENER;
+	l->sock = sock;
+	l->protocol = protocol;
+	l->des_key = des_key;
+	l->worker = worker;
+	return 0;
+}
+
+static int slab_grow(struct worker * w) {
+	struct conn * slab;
+	int i;
+
+	if ((slab = malloc(SERVER_SLAB_CONNS * sizeof(struct conn))) == NULL)
+		return -1;
+
+	for (i = 0; i < SERVER_SLAB_CONNS; i++) {
+		slab[i].next_free = w->free_conns;
+		w->free_conns = &slab[i];
+	}
+	return 0;
+}
+
+static struct conn * conn_alloc(struct worker * w) {
+	struct conn * c;
+
+	if (w->free_conns == NULL && slab_grow(w) < 0)
+		return NULL;
+
+	c = w->free_conns;
+	w->free_conns = c->next_free;
+	memset(c, 0, offsetof(struct conn, buf));
+	return c;
+}
+
+static void conn_close(struct worker * w, struct conn * c) {
+	LOG(INFO, "[VMCAM] Connection closed");
+	close(c->fd);
+	c->next_free = w->free_conns;
+	w->free_conns = c;
+}
+
+static int conn_frame_len(struct conn * c, const unsigned char * buf, int len) {
+	if (c->listener->protocol == SERVER_NEWCAMD)
+		return newcamd_frame_len(buf, len);
+	else
+		return cs378x_frame_len(&c->proto.cs378x, buf, len);
+}
+
+static int conn_parse_frame(struct conn * c, unsigned char * frame, int len, unsigned char ** ecm) {
+	if (c->listener->protocol == SERVER_NEWCAMD)
+		return newcamd_parse(&c->proto.newcamd, frame, len, ecm);
+	else
+		return cs378x_parse(&c->proto.cs378x, frame, len, ecm);
+}
+
+static int conn_handle_frame(struct conn * c, unsigned char * frame, const unsigned char * dcw) {
+	if (c->listener->protocol == SERVER_NEWCAMD)
+		return newcamd_handle(&c->proto.newcamd, frame, dcw);
+	else
+		return cs378x_handle(&c->proto.cs378x, frame, dcw);
+}
+
+/*
+ * Sends as much of the pending output as the socket takes. Whatever is
+ * left is sent when EPOLLOUT signals the socket is writable again.
+ */
+static int conn_flush(struct conn * c) {
+	ssize_t n;
+
+#ifdef HAVE_IO_URING
+	if (c->ring != NULL)
+		return uring_flush(c);
+#endif
+
+	while (c->out.len > 0) {
+		n = send(c->fd, c->outbuf, c->out.len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+
+		c->out.len -= n;
+		if (c->out.len > 0)
+			memmove(c->outbuf, c->outbuf + n, c->out.len);
+	}
+	return 0;
+}
+
+/*
+ * ECMs parsed from one read, decrypted together once the read is parsed or
+ * another message has to be answered first. The ECM sections are copied
+ * since keyblock_analyse_batch() decrypts them in place.
+ */
+struct conn_batch {
+	int count;
+	unsigned char * frame[SERVER_BATCH_MAX];
+	struct keyblock_ecm ecms[SERVER_BATCH_MAX];
+	unsigned char ecm[SERVER_BATCH_MAX][KEYBLOCK_ECM_LEN];
+	unsigned char dcw[SERVER_BATCH_MAX][32];
+};
+
+static void conn_batch_add(struct conn_batch * b, unsigned char * frame, const unsigned char * ecm, int len) {
+	int i = b->count++;
+
+	if (len > KEYBLOCK_ECM_LEN)
+		len = KEYBLOCK_ECM_LEN;
+
+	memcpy(b->ecm[i], ecm, len);
+	memset(b->ecm[i] + len, 0, KEYBLOCK_ECM_LEN - len);
+	memset(b->dcw[i], 0, sizeof(b->dcw[i]));
+	b->frame[i] = frame;
+	b->ecms[i].ecm = b->ecm[i];
+	b->ecms[i].dcw = b->dcw[i];
+}
+
+/*
+ * Decrypts the gathered ECMs and encodes their replies in request order.
+ */
+static int conn_batch_answer(struct conn * c, struct conn_batch * b) {
+	int i;
+
+	if (b->count == 0)
+		return 0;
+
+	ecm_handler(b->ecms, b->count);
+	for (i = 0; i < b->count; i++) {
+		if (conn_handle_frame(c, b->frame[i], b->dcw[i]) < 0)
+			return -1;
+	}
+
+	b->count = 0;
+	return 0;
+}
+
+/*
+ * Handles all complete frames in the receive buffer and moves a remaining
+ * partial frame to the front. ECMs are gathered and decrypted as one batch,
+ * other messages are answered in order after the ECMs in front of them.
+ * When the output buffer can't take another reply the remaining frames
+ * wait until the client reads its replies.
+ * Returns -1 when the connection has to be closed.
+ */
+static int conn_parse(struct conn * c) {
+	struct conn_batch batch;
+	unsigned char * ecm;
+	int need, ret, off = 0;
+
+	batch.count = 0;
+	while ((need = conn_frame_len(c, c->buf + off, c->have - off)) > 0 && need <= c->have - off) {
+		if (c->out.size - c->out.len < (batch.count + 1) * SERVER_REPLY_MAX) {
+			if (conn_batch_answer(c, &batch) < 0 || conn_flush(c) < 0)
+				return -1;
+			if (c->out.size - c->out.len < SERVER_REPLY_MAX)
+				break;
+		}
+
+		if ((ret = conn_parse_frame(c, c->buf + off, need, &ecm)) < 0)
+			return -1;
+
+		if (ret > 0) {
+			conn_batch_add(&batch, c->buf + off, ecm, ret);
+		} else if (conn_batch_answer(c, &batch) < 0 || conn_handle_frame(c, c->buf + off, NULL) < 0) {
+			return -1;
+		}
+		off += need;
+	}
+
+	if (need < 0 || need > SERVER_BUF_LEN)
+		return -1;
+
+	if (conn_batch_answer(c, &batch) < 0)
+		return -1;
+
+	if (off > 0) {
+		memmove(c->buf, c->buf + off, c->have - off);
+		c->have -= off;
+	}
+	return 0;
+}
+
+/*
+ * Receives until the socket is drained. A read shorter than the free space
+ * means the kernel had nothing more queued, so the EAGAIN round trip is
+ * skipped and the next edge wakes us up again.
+ */
+static int conn_read(struct conn * c) {
+	ssize_t n;
+	int space;
+
+	while ((space = SERVER_BUF_LEN - c->have) > 0) {
+		n = recv(c->fd, c->buf + c->have, space, 0);
+		if (n == 0)
+			return -1;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+
+		c->have += n;
+		if (conn_parse(c) < 0)
+			return -1;
+
+		if (n < space)
+			return 0;
+	}
+	return 0;
+}
+
+static int conn_event(struct conn * c) {
+	if (conn_flush(c) < 0 || conn_parse(c) < 0 || conn_read(c) < 0)
+		return -1;
+
+	return conn_flush(c);
+}
+
+static void conn_init(struct conn * c, int fd, struct listener * l) {
+	int one = 1;
+
+	c->type = HANDLE_CONN;
+	c->fd = fd;
+	c->listener = l;
+	c->out.data = c->outbuf;
+	c->out.size = SERVER_BUF_LEN;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (l->protocol == SERVER_NEWCAMD) {
+		c->proto.newcamd.client_fd = fd;
+		newcamd_init(&c->proto.newcamd, l->des_key);
+		c->proto.newcamd.out = &c->out;
+	} else {
+		c->proto.cs378x.client_fd = fd;
+		cs378x_init(&c->proto.cs378x);
+		c->proto.cs378x.out = &c->out;
+	}
+}
+
+static void conn_accept(struct worker * w, struct listener * l) {
+	struct epoll_event ev;
+	struct conn * c;
+	int fd;
+
+	while ((fd = accept4(l->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		LOG(INFO, "[VMCAM] Got connection");
+
+		if ((c = conn_alloc(w)) == NULL) {
+			LOG(ERROR, "[SERVER] Not enough memory for connection");
+			close(fd);
+			continue;
+		}
+		conn_init(c, fd, l);
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = c;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			LOG(ERROR, "[SERVER] Can't add connection to worker %d: %s", w->id, strerror(errno));
+			conn_close(w, c);
+		}
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		LOG(ERROR, "[VMCAM] Can't accept: %s", strerror(errno));
+}
+
+#ifdef HAVE_IO_URING
+enum uring_op {
+	URING_ACCEPT = 1,
+	URING_RECV,
+	URING_SEND,
+	URING_SHUTDOWN,
+	URING_CANCEL,
+};
+
+#define URING_OP_MASK 7
+
+/*
+ * Returns an SQE for an operation on @c, its user data is the connection
+ * tagged with the operation in the low bits.
+ */
+static struct io_uring_sqe * uring_conn_sqe(struct conn * c, enum uring_op op) {
+	struct io_uring_sqe * sqe;
+
+	if ((sqe = uring_get_sqe(c->ring)) == NULL) {
+		LOG(ERROR, "[SERVER] io_uring submission queue is stuck");
+		return NULL;
+	}
+
+	sqe->fd = c->fd;
+	sqe->user_data = (uintptr_t) c | op;
+	c->pending++;
+	return sqe;
+}
+
+static void uring_arm_accept(struct uring * r, struct listener * l) {
+	struct io_uring_sqe * sqe;
+
+	if ((sqe = uring_get_sqe(r)) == NULL) {
+		LOG(ERROR, "[SERVER] Can't accept on listener %d", l->sock);
+		return;
+	}
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = l->sock;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = (uintptr_t) l | URING_ACCEPT;
+}
+
+/*
+ * Stops a connection. A pending reply is sent first with the shutdown
+ * linked behind it, the shutdown ends the multishot receive. The
+ * connection is freed when its last operation completed.
+ */
+static void uring_close(struct conn * c) {
+	struct io_uring_sqe * sqe;
+
+	if (c->closing)
+		return;
+	c->closing = 1;
+
+	if (c->sending == 0 && c->out.len > 0 && (sqe = uring_conn_sqe(c, URING_SEND)) != NULL) {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (uintptr_t) c->outbuf;
+		sqe->len = c->out.len;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->flags = IOSQE_IO_LINK;
+		c->sending = c->out.len;
+	}
+
+	if ((sqe = uring_conn_sqe(c, URING_SHUTDOWN)) != NULL) {
+		sqe->opcode = IORING_OP_SHUTDOWN;
+		sqe->len = SHUT_RDWR;
+	} else {
+		shutdown(c->fd, SHUT_RDWR);
+	}
+}
+
+/*
+ * Keeps a receive in flight while the connection can take more data. A
+ * multishot receive is only armed with an empty input buffer and room for
+ * replies, otherwise a single receive limited to the free input space is
+ * used. Once received data has to be held back a running multishot
+ * receive is cancelled, the next receive is armed when it was consumed.
+ */
+static void uring_arm_recv(struct conn * c) {
+	struct io_uring_sqe * sqe;
+	int space = SERVER_BUF_LEN - c->have;
+
+	if (c->closing)
+		return;
+
+	if (c->held >= 0 || space == 0) {
+		if (c->receiving && c->multishot && (sqe = uring_conn_sqe(c, URING_CANCEL)) != NULL) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (uintptr_t) c | URING_RECV;
+			c->multishot = 0;
+		}
+		return;
+	}
+
+	if (c->receiving)
+		return;
+
+	if ((sqe = uring_conn_sqe(c, URING_RECV)) == NULL) {
+		uring_close(c);
+		return;
+	}
+
+	c->receiving = 1;
+	c->multishot = c->have == 0 && c->out.size - c->out.len >= SERVER_REPLY_MAX;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->ioprio = c->multishot ? IORING_RECV_MULTISHOT : 0;
+	sqe->len = c->multishot ? 0 : space;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+}
+
+/*
+ * Queues a provided buffer with @len received bytes behind the data the
+ * connection holds already.
+ */
+static void uring_hold(struct conn * c, unsigned short bid, int len) {
+	struct worker * w = c->worker;
+
+	w->held_len[bid] = len;
+	w->held_next[bid] = -1;
+	if (c->held < 0)
+		c->held = bid;
+	else
+		w->held_next[c->held_tail] = bid;
+	c->held_tail = bid;
+}
+
+static void uring_release(struct conn * c) {
+	int bid;
+
+	while ((bid = c->held) >= 0) {
+		c->held = c->worker->held_next[bid];
+		uring_recycle_buffer(c->ring, bid);
+	}
+}
+
+/*
+ * Moves held data into @buf as far as it fits and handles the frames in
+ * it. What doesn't fit stays held until sent replies let further frames
+ * be handled. Returns -1 when the connection has to be closed.
+ */
+static int uring_drain(struct conn * c) {
+	struct worker * w = c->worker;
+	int bid, n;
+
+	if (conn_parse(c) < 0)
+		return -1;
+
+	while ((bid = c->held) >= 0 && (n = SERVER_BUF_LEN - c->have) > 0) {
+		if (n > w->held_len[bid] - c->held_off)
+			n = w->held_len[bid] - c->held_off;
+
+		memcpy(c->buf + c->have, uring_buffer(c->ring, bid) + c->held_off, n);
+		c->have += n;
+		c->held_off += n;
+		if (c->held_off == w->held_len[bid]) {
+			c->held = w->held_next[bid];
+			c->held_off = 0;
+			uring_recycle_buffer(c->ring, bid);
+		}
+
+		if (conn_parse(c) < 0)
+			return -1;
+	}
+
+	return uring_flush(c);
+}
+
+/*
+ * Queues a send of the pending output unless one is in flight already.
+ * Replies encoded meanwhile are appended behind the part being sent.
+ */
+static int uring_flush(struct conn * c) {
+	struct io_uring_sqe * sqe;
+
+	if (c->sending > 0 || c->out.len == 0 || c->closing)
+		return 0;
+
+	if ((sqe = uring_conn_sqe(c, URING_SEND)) == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->addr = (uintptr_t) c->outbuf;
+	sqe->len = c->out.len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	c->sending = c->out.len;
+	return 0;
+}
+
+static void uring_accept(struct worker * w, struct uring * r, struct listener * l, struct io_uring_cqe * cqe) {
+	struct conn * c;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		uring_arm_accept(r, l);
+
+	if (cqe->res < 0) {
+		LOG(ERROR, "[VMCAM] Can't accept: %s", strerror(-cqe->res));
+		return;
+	}
+
+	LOG(INFO, "[VMCAM] Got connection");
+	if ((c = conn_alloc(w)) == NULL) {
+		LOG(ERROR, "[SERVER] Not enough memory for connection");
+		close(cqe->res);
+		return;
+	}
+
+	conn_init(c, cqe->res, l);
+	c->ring = r;
+	c->worker = w;
+	c->held = -1;
+	uring_arm_recv(c);
+}
+
+static void uring_recv(struct conn * c, struct io_uring_cqe * cqe) {
+	unsigned short bid;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		c->pending--;
+		c->receiving = 0;
+	}
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe->res > 0 && !c->closing)
+			uring_hold(c, bid, cqe->res);
+		else
+			uring_recycle_buffer(c->ring, bid);
+	}
+
+	if (c->closing)
+		return;
+
+	if (uring_drain(c) < 0) {
+		uring_close(c);
+		return;
+	}
+
+	// Multishot receives also end when the provided buffers ran out or on cancel
+	if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED))
+		uring_close(c);
+	else
+		uring_arm_recv(c);
+}
+
+static void uring_sent(struct conn * c, struct io_uring_cqe * cqe) {
+	c->pending--;
+	if (cqe->res < 0) {
+		c->sending = 0;
+		uring_close(c);
+		return;
+	}
+
+	c->out.len -= cqe->res;
+	if (c->out.len > 0)
+		memmove(c->outbuf, c->outbuf + cqe->res, c->out.len);
+	c->sending = 0;
+
+	// Frames held back while the output buffer was full
+	if (c->closing)
+		return;
+
+	if (uring_drain(c) < 0)
+		uring_close(c);
+	else
+		uring_arm_recv(c);
+}
+
+static void uring_complete(struct worker * w, struct uring * r, struct io_uring_cqe * cqe) {
+	void * ptr = (void *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+	struct conn * c = ptr;
+
+	switch (cqe->user_data & URING_OP_MASK) {
+		case URING_ACCEPT:
+			uring_accept(w, r, ptr, cqe);
+			return;
+		case URING_RECV:
+			uring_recv(c, cqe);
+			break;
+		case URING_SEND:
+			uring_sent(c, cqe);
+			break;
+		case URING_SHUTDOWN:
+			c->pending--;
+			// Cancelled when the linked send failed
+			if (cqe->res < 0)
+				shutdown(c->fd, SHUT_RDWR);
+			break;
+		case URING_CANCEL:
+			c->pending--;
+			break;
+	}
+
+	if (c->closing && c->pending == 0) {
+		uring_release(c);
+		conn_close(w, c);
+	}
+}
+
+/*
+ * io_uring worker loop. Listeners have a multishot accept and every
+ * connection a multishot receive into the ring's provided buffers, so
+ * one io_uring_enter() submits all sends queued while handling the last
+ * batch of completions and waits for the next. Returns when the ring
+ * can't be set up, the worker falls back to epoll then.
+ */
+static int worker_run_uring(struct worker * w) {
+	struct uring r;
+	struct io_uring_cqe * cqe;
+	int i;
+
+	if (uring_init(&r, SERVER_URING_ENTRIES) < 0) {
+		LOG(ERROR, "[SERVER] Can't set up io_uring for worker %d: %s", w->id, strerror(errno));
+		return -1;
+	}
+
+	if (uring_setup_buffers(&r, 0, SERVER_URING_BUFS, SERVER_BUF_LEN) < 0) {
+		LOG(ERROR, "[SERVER] Can't register io_uring buffers for worker %d: %s", w->id, strerror(errno));
+		uring_exit(&r);
+		return -1;
+	}
+
+	for (i = 0; i < listener_count; i++) {
+		if (listeners[i].worker < 0 || listeners[i].worker == w->id)
+			uring_arm_accept(&r, &listeners[i]);
+	}
+
+	while (1) {
+		if (uring_submit(&r, 1) < 0 && errno != EINTR && errno != EBUSY)
+			LOG(ERROR, "[SERVER] io_uring_enter failed in worker %d: %s", w->id, strerror(errno));
+
+		while ((cqe = uring_peek_cqe(&r)) != NULL) {
+			uring_complete(w, &r, cqe);
+			uring_cqe_seen(&r);
+		}
+	}
+
+	return 0;
+}
+#endif
+
+static void *worker_run(void * arg) {
+	struct worker * w = arg;
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	enum handle_type * type;
+	struct conn * c;
+	int i, n;
+
+#ifdef HAVE_IO_URING
+	if (backend == SERVER_URING)
+		worker_run_uring(w);
+#endif
+
+	while (1) {
+		n = epoll_wait(w->epfd, events, SERVER_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno != EINTR)
+				LOG(ERROR, "[SERVER] epoll_wait failed in worker %d: %s", w->id, strerror(errno));
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			type = events[i].data.ptr;
+			if (*type == HANDLE_LISTENER) {
+				conn_accept(w, events[i].data.ptr);
+				continue;
+			}
+
+			// A reply queued before the failure, like a login NAK, still goes out
+			c = events[i].data.ptr;
+			if (conn_event(c) < 0 || (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+				conn_flush(c);
+				conn_close(w, c);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts @count worker threads, each running its own epoll loop. Shared
+ * listeners are watched by every worker with EPOLLEXCLUSIVE, so a new
+ * connection wakes one worker which then owns it for its lifetime.
+ * Listeners bound to a worker (SO_REUSEPORT) are only watched by that
+ * worker, leaving the distribution to the kernel. With @pin set worker i
+ * runs on CPU i modulo the number of CPUs. A @stack_size of 0 keeps the
+ * default thread stack size.
+ */
+int server_start(int count, size_t stack_size, int pin, void (*f)(struct keyblock_ecm*, size_t)) {
+	struct worker * workers;
+	struct epoll_event ev;
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, j;
+
+	if (count < 1)
+		count = 1;
+
+	ecm_handler = f;
+	if ((workers = calloc(count, sizeof(struct worker))) == NULL) {
+		LOG(ERROR, "[SERVER] Not enough memory for workers");
+		return -1;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (stack_size > 0 && pthread_attr_setstacksize(&attr, stack_size < (size_t) PTHREAD_STACK_MIN ? (size_t) PTHREAD_STACK_MIN : stack_size) != 0)
+		LOG(ERROR, "[SERVER] Can't set worker stack size to %zu, using default", stack_size);
+
+	for (i = 0; i < count; i++) {
+		workers[i].id = i;
+		if ((workers[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+			LOG(ERROR, "[SERVER] Can't create epoll instance: %s", strerror(errno));
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
+
+		for (j = 0; j < listener_count; j++) {
+			if (listeners[j].worker >= 0 && listeners[j].worker != i)
+				continue;
+
+			ev.events = listeners[j].worker < 0 ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+			ev.data.ptr = &listeners[j];
+			if (epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, listeners[j].sock, &ev) < 0) {
+				LOG(ERROR, "[SERVER] Can't add listener to worker %d: %s", i, strerror(errno));
+				pthread_attr_destroy(&attr);
+				return -1;
+			}
+		}
+
+		if (slab_grow(&workers[i]) < 0) {
+			LOG(ERROR, "[SERVER] Not enough memory for connections");
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
+
+		if (pin && ncpu > 0) {
+			CPU_ZERO(&cpus);
+			CPU_SET(i % ncpu, &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+
+		if ((errno = pthread_create(&workers[i].thread, &attr, worker_run, &workers[i])) != 0) {
+			LOG(ERROR, "[SERVER] Can't start worker %d: %s", i, strerror(errno));
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	LOG(INFO, "[VMCAM] Serving clients with %d %s worker threads", count, backend == SERVER_URING ? "io_uring" : "epoll");
+	return 0;
+}
@@ -0,0 +1,37 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "keyblock.h"
+
+enum server_protocol {
+	SERVER_NEWCAMD,
+	SERVER_CS378X,
+};
+
+enum server_backend {
+	SERVER_EPOLL,
+	SERVER_URING,
+};
+
+int server_set_backend(enum server_backend backend);
+int server_add_listener(int sock, enum server_protocol protocol, const unsigned char * des_key, int worker);
+int server_start(int workers, size_t stack_size, int pin, void (*f)(struct keyblock_ecm*, size_t));
@@ -3,7 +3,9 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <errno.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -15,6 +17,7 @@
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #endif
@@ -25,6 +28,8 @@
 
 #include "log.h"
 
+#define SSL_CLIENT_HDR_LEN 4	// Length of the response after it
+
 #define RETURN_NULL(x) if ((x)==NULL) exit (1)
 #define RETURN_ERR(err,s) if (err<0) { LOG(ERROR, "[ssl-client] %s", s); return(-1); }
 #define RETURN_SSL(err) if (err<0) { LOG(ERROR, "[ssl-client] error: %d", err); return(-1); }
@@ -45,6 +50,75 @@ int verify_client = OFF; /* To verify a client certificate, set ON */
 X509 *server_cert;
 EVP_PKEY *pkey;
 
+/*
+ * One context for all VCAS calls. Its client session cache lets the next
+ * call resume the last session instead of doing a full RSA handshake.
+ */
+static SSL_CTX *ssl_ctx;
+static int ssl_legacy;
+static SSL_SESSION *ssl_session;
+static char ssl_session_peer[NI_MAXHOST + 8];
+
+// TLS 1.3 tickets arrive after the handshake, so keep the latest one
+static int ssl_client_new_session(SSL *ssl, SSL_SESSION *session) {
+	(void) ssl;
+	if (ssl_session != NULL)
+		SSL_SESSION_free(ssl_session);
+	ssl_session = session;
+	return 1;
+}
+
+/* Monotonic time in ns after which calls fail, zero waits forever */
+static uint64_t ssl_client_deadline;
+
+static uint64_t ssl_client_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Calls fail once @ms passed from now, however slowly the server sends */
+void ssl_client_set_deadline(int ms) {
+	ssl_client_deadline = ms > 0 ? ssl_client_now() + (uint64_t) ms * 1000000 : 0;
+}
+
+/* Bounds the next operation on @sock by the time left, -1 when it's up */
+static int ssl_client_remaining(int sock) {
+	struct timeval tv;
+	uint64_t now, left;
+
+	if (ssl_client_deadline == 0)
+		return 0;
+
+	if ((now = ssl_client_now()) >= ssl_client_deadline) {
+		LOG(ERROR, "[ssl-client] Deadline passed");
+		return -1;
+	}
+
+	left = (ssl_client_deadline - now) / 1000 + 1;	// Rounded up to us, 0 would wait forever
+	tv.tv_sec = left / 1000000;
+	tv.tv_usec = left % 1000000;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return 0;
+}
+
+static int ssl_client_socket(const struct addrinfo *ai) {
+	int sock;
+
+	if ((sock = socket(ai->ai_family, ai->ai_socktype, 0)) >= 0 && ssl_client_remaining(sock) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* Allows the weak keys and ciphers of old head-ends, before ssl_client_init() */
+void ssl_client_set_legacy(int legacy) {
+	ssl_legacy = legacy;
+}
+
 void ssl_client_init() {
 	/* Load encryption & hashing algorithms for the SSL program */
 	SSL_library_init();
@@ -52,44 +126,64 @@ void ssl_client_init() {
 	/* Load the error strings for SSL & CRYPTO APIs */
 	SSL_load_error_strings();
 
+	if (ssl_ctx != NULL)
+		return;
+
+	if ((ssl_ctx = SSL_CTX_new(TLS_client_method())) == NULL) {
+		LOG(ERROR, "[ssl-client] Can't create SSL context");
+		return;
+	}
+
+	/* Negotiate the best version, VCAS servers in the field may only speak TLS 1.0 */
+	SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_VERSION);
+	if (ssl_legacy && SSL_CTX_set_cipher_list(ssl_ctx, "DEFAULT:@SECLEVEL=0") != 1)
+		LOG(ERROR, "[ssl-client] Can't lower the security level for TLS_LEGACY");
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	SSL_CTX_set_options(ssl_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ssl_ctx, ssl_client_new_session);
+}
+
+/* Every read and write OpenSSL does on the socket only gets the time left */
+static long ssl_client_bio_callback(BIO *bio, int oper, const char *argp, size_t len,
+		int argi, long argl, int ret, size_t *processed) {
+	(void) argp;
+	(void) len;
+	(void) argi;
+	(void) argl;
+	(void) processed;
+	if ((oper == BIO_CB_READ || oper == BIO_CB_WRITE) && ssl_client_remaining(BIO_get_fd(bio, NULL)) < 0)
+		return -1;
+	return ret;
+}
+
+static uint32_t ssl_client_length(const unsigned char * p) {
+	return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
 }
 
 int ssl_client_send(unsigned char * msg, uint16_t msglen,
 		unsigned char*buf_received, uint16_t responsebuflen, const char *s_addr,
 		short int s_port) {
-	SSL_CTX *ctx;
-	SSL *ssl_sock;
+	SSL *ssl_sock = NULL;
 	int err;
 	int sock;
-	int datarecv;
+	int datarecv = -1;
+	int expected, framed;
+	uint32_t length;
 	/* Use getaddrinfo to get server address */
 	char port_str[7];
+	char peer[sizeof(ssl_session_peer)];
 	struct addrinfo *aires;
 	struct addrinfo hints = {0};
 	const struct addrinfo *ai;
-	/* Create an SSL_METHOD structure (choose an SSL/TLS protocol version) */
-	const SSL_METHOD *meth = TLSv1_method();
 	char *str;
-	/* Create an SSL_CTX structure */
-	ctx = SSL_CTX_new(meth);
-
-	RETURN_NULL(ctx);
-
-	/* Load the RSA CA certificate into the SSL_CTX structure */
-	/* This will allow this client to verify the server's     */
-	/* certificate.                                           */
-
-	/*if (!SSL_CTX_load_verify_locations(ctx, RSA_CLIENT_CA_CERT, NULL)) {
-	 ERR_print_errors_fp(stderr);
-	 exit(1);
-	 }
-	 */
-	/* Set flag in context to require peer (server) certificate */
-	/* verification */
 
-	//SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
-	//SSL_CTX_set_verify_depth(ctx, 1);
-	/* ------------------------------------------------------------- */
+	if (ssl_ctx == NULL) {
+		LOG(ERROR, "[ssl-client] No SSL context");
+		return -1;
+	}
 
 	/* Establish a TCP/IP connection to the SSL client */
 
@@ -104,35 +198,51 @@ int ssl_client_send(unsigned char * msg, uint16_t msglen,
 	err = getaddrinfo(s_addr, port_str, &hints, &aires);
 	RETURN_ERR(err, "getaddrinfo");
 
-	ai = aires;
-	for (;ai != NULL &&
-		((sock = socket(ai->ai_family, ai->ai_socktype, 0)) < 0 ||
-		(err = connect(sock, ai->ai_addr, ai->ai_addrlen)) < 0);
-		close(sock), sock = 0, ai = ai->ai_next);
+	// @sock stays -1 unless an address connected
+	sock = -1;
+	for (ai = aires; ai != NULL && sock < 0; ai = ai->ai_next) {
+		if ((sock = ssl_client_socket(ai)) >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+			close(sock);
+			sock = -1;
+		}
+	}
 
 	freeaddrinfo(aires);
 
-	RETURN_ERR(sock, "socket");
-	RETURN_ERR(err, "connect");
+	RETURN_ERR(sock, "connect");
 
 	/* ----------------------------------------------- */
 	/* An SSL structure is created */
 
-	ssl_sock = SSL_new(ctx);
-
-	RETURN_NULL(ssl_sock);
+	if ((ssl_sock = SSL_new(ssl_ctx)) == NULL) {
+		LOG(ERROR, "[ssl-client] Can't create SSL connection");
+		goto cleanup;
+	}
 
 	/* Assign the socket into the SSL structure (SSL and socket without BIO) */
 	SSL_set_fd(ssl_sock, sock);
+	BIO_set_callback_ex(SSL_get_rbio(ssl_sock), ssl_client_bio_callback);
+
+	/* Offer the session of the previous call to the same server */
+	snprintf(peer, sizeof(peer), "%s:%d", s_addr, s_port);
+	if (ssl_session != NULL && strcmp(peer, ssl_session_peer) != 0) {
+		SSL_SESSION_free(ssl_session);
+		ssl_session = NULL;
+	}
+	strcpy(ssl_session_peer, peer);
+	if (ssl_session != NULL)
+		SSL_set_session(ssl_sock, ssl_session);
 
 	SSL_set_connect_state(ssl_sock);
 	/* Perform SSL Handshake on the SSL client */
-	err = SSL_connect(ssl_sock);
-
-        RETURN_SSL(err);
+	if ((err = SSL_connect(ssl_sock)) <= 0) {
+		LOG(ERROR, "[ssl-client] Handshake failed: %d", SSL_get_error(ssl_sock, err));
+		goto cleanup;
+	}
 
 	/* Informational output (optional) */
-	LOG(DEBUG, "[ssl-client] SSL connection using %s", SSL_get_cipher(ssl_sock));
+	LOG(DEBUG, "[ssl-client] %s %s connection using %s", SSL_session_reused(ssl_sock) ? "Resumed" : "New",
+			SSL_get_version(ssl_sock), SSL_get_cipher(ssl_sock));
 
 	/* Get the server's certificate (optional) */
 	server_cert = SSL_get_peer_certificate(ssl_sock);
@@ -158,34 +268,61 @@ int ssl_client_send(unsigned char * msg, uint16_t msglen,
 	/*-------- DATA EXCHANGE - send message and receive reply. -------*/
 	/* Send data to the SSL server */
 
-	err = SSL_write(ssl_sock, msg, msglen);
-
-	RETURN_SSL(err);
-
-	/* Receive data from the SSL server */
-
-	err = SSL_read(ssl_sock, buf_received, responsebuflen);
+	if ((err = SSL_write(ssl_sock, msg, msglen)) <= 0) {
+		LOG(ERROR, "[ssl-client] Write failed: %d", SSL_get_error(ssl_sock, err));
+		goto cleanup;
+	}
 
-	RETURN_SSL(err);
-
-	datarecv = err;
+	/*
+	 * A response starts with the big endian length of what follows it, it's
+	 * read up to that length even when the server keeps the connection open.
+	 * Without a length it's read until the server closes. Anything short of
+	 * that, like a timeout, fails the call.
+	 */
+	datarecv = 0;
+	expected = responsebuflen;
+	framed = 0;
+	while (datarecv < expected && (err = SSL_read(ssl_sock, buf_received + datarecv, expected - datarecv)) > 0) {
+		datarecv += err;
+		if (!framed && datarecv >= SSL_CLIENT_HDR_LEN && (length = ssl_client_length(buf_received)) > 0) {
+			if (length > (uint32_t) responsebuflen - SSL_CLIENT_HDR_LEN) {
+				LOG(ERROR, "[ssl-client] Response of %u bytes doesn't fit in %d bytes", length, responsebuflen - SSL_CLIENT_HDR_LEN);
+				datarecv = -1;
+				goto cleanup;
+			}
+			expected = length + SSL_CLIENT_HDR_LEN;
+			framed = 1;
+		}
+	}
+
+	if (datarecv < expected && (framed || SSL_get_error(ssl_sock, err) != SSL_ERROR_ZERO_RETURN)) {
+		LOG(ERROR, "[ssl-client] Read failed after %d of %d bytes: %d", datarecv, framed ? expected : 0, SSL_get_error(ssl_sock, err));
+		datarecv = -1;
+		goto cleanup;
+	}
+
+	if (datarecv == 0) {
+		LOG(ERROR, "[ssl-client] Server closed without a response");
+		datarecv = -1;
+		goto cleanup;
+	}
 
 	LOG(DEBUG, "[ssl-client] Received %d", datarecv);
 
 	/*--------------- SSL closure ---------------*/
-	/* Shutdown the client side of the SSL connection */
-	err = SSL_shutdown(ssl_sock);
-	RETURN_SSL(err);
+	/* Shutdown the client side of the SSL connection, which keeps the session resumable */
+	SSL_shutdown(ssl_sock);
 
-	/* Terminate communication on a socket */
-	err = close(sock);
+cleanup:
+	/* A session the server didn't accept isn't offered again */
+	if (datarecv < 0 && ssl_session != NULL) {
+		SSL_SESSION_free(ssl_session);
+		ssl_session = NULL;
+	}
 
-	RETURN_ERR(err, "close");
-
-	/* Free the SSL structure */
 	SSL_free(ssl_sock);
 
-	/* Free the SSL_CTX structure */
-	SSL_CTX_free(ctx);
+	/* Terminate communication on a socket */
+	close(sock);
 	return datarecv;
 }
@@ -11,6 +11,8 @@
 int ssl_client_send(unsigned char *msg, uint16_t msglen, unsigned char*buf_received,uint16_t responselen,
 		const char *s_addr, short int s_port);
 void ssl_client_init();
+void ssl_client_set_legacy(int legacy);
+void ssl_client_set_deadline(int ms);
 
 
 
@@ -0,0 +1,135 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "synth.h"
+#include "ecmfile.h"
+#include "keyblock.h"
+#include "aesdec.h"
+#include "log.h"
+
+/*
+ * Writes a synthetic keyblock in the layout the VKS delivers and optionally
+ * a file of ECMs for tables 0x80 and 0x81 which decrypt under its master
+ * keys. Every ECM is checked against the keyblock code before it is
+ * written, so the files exercise the same path as operator data.
+ */
+int main(int argc, char *argv[]) {
+	const char * keyblock_path = NULL, * ecm_path = NULL;
+	unsigned int channels = 1000, first = 1000, per_channel = 2, interval = 0;
+	unsigned int i, j, k, count = 0, usage = 0;
+	unsigned char * keyblock, mkey[16], work[SYNTH_ECM_LEN], dcw[32];
+	uint64_t seed = 1, rng;
+	struct ecmfile_record record;
+	uint16_t channel;
+	size_t len;
+	FILE * f;
+
+	for (i = 1; i < (unsigned int) argc && usage == 0; i++) {
+		if (i + 1 >= (unsigned int) argc) {
+			usage = 1;
+		} else if (strcmp(argv[i], "-kb") == 0) {
+			keyblock_path = argv[++i];
+		} else if (strcmp(argv[i], "-ecm") == 0) {
+			ecm_path = argv[++i];
+		} else if (strcmp(argv[i], "-ch") == 0) {
+			channels = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-first") == 0) {
+			first = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-seed") == 0) {
+			seed = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-n") == 0) {
+			per_channel = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-interval") == 0) {
+			interval = atoi(argv[++i]);
+		} else {
+			usage = 1;
+		}
+	}
+
+	if (keyblock_path == NULL || channels < 1 || first + channels > 0x10000)
+		usage = 1;
+
+	if (usage) {
+		printf("Usage: vmcam-synth -kb [keyblock] [options]\n\n");
+		printf("\t-kb [keyblock]\t\tKeyblock file to write\n");
+		printf("\t-ch [channels]\t\tNumber of channels [default: 1000]\n");
+		printf("\t-first [channel]\tId of the first channel [default: 1000]\n");
+		printf("\t-seed [seed]\t\tSeed for keys and control words [default: 1]\n\n");
+		printf("\t-ecm [file]\t\tECM file to write\n");
+		printf("\t-n [ECMs]\t\tECMs per channel, alternating tables 0x80 and 0x81 [default: 2]\n");
+		printf("\t-interval [ms]\t\tTime between the ECMs of a channel in the file [default: 0]\n");
+		return EXIT_FAILURE;
+	}
+
+	if ((keyblock = synth_keyblock(channels, first, seed, &len)) == NULL)
+		return EXIT_FAILURE;
+
+	if ((f = fopen(keyblock_path, "wb")) == NULL || fwrite(keyblock, len, 1, f) != 1 || fclose(f) != 0) {
+		fprintf(stderr, "Could not write keyblock %s\n", keyblock_path);
+		return EXIT_FAILURE;
+	}
+	printf("Wrote keyblock with %u channels to %s\n", channels, keyblock_path);
+
+	if (ecm_path == NULL)
+		return EXIT_SUCCESS;
+
+	aesdec_init(0);
+	if (keyblock_load(keyblock, len) < 0 || (f = ecmfile_create(ecm_path)) == NULL)
+		return EXIT_FAILURE;
+
+	rng = seed ^ 0x766d63616d;
+	memset(&record, 0, sizeof(record));
+	record.len = SYNTH_ECM_LEN;
+	record.flags = ECMFILE_HAS_CW;
+
+	// Round robin over the channels, like a headend cycling its ECMs
+	for (j = 0; j < per_channel; j++) {
+		for (i = 0; i < channels; i++) {
+			synth_keyblock_mkey(keyblock, i, time(NULL), &channel, mkey);
+			for (k = 0; k < 32; k++)
+				record.cw[k] = synth_rand(&rng);
+			synth_ecm(record.ecm, mkey, channel, 0x80 | (j & 1), record.cw);
+			record.time_ms = j * interval;
+
+			memcpy(work, record.ecm, SYNTH_ECM_LEN);
+			if (keyblock_analyse(dcw, work) != 1 || memcmp(dcw, record.cw, 32) != 0) {
+				fprintf(stderr, "ECM for channel %u doesn't decrypt to its control words\n", channel);
+				return EXIT_FAILURE;
+			}
+
+			if (ecmfile_write(f, &record) < 0) {
+				fprintf(stderr, "Could not write ECM file %s\n", ecm_path);
+				return EXIT_FAILURE;
+			}
+			count++;
+		}
+	}
+
+	if (fclose(f) != 0)
+		return EXIT_FAILURE;
+
+	printf("Wrote %u ECMs to %s\n", count, ecm_path);
+	free(keyblock);
+	return EXIT_SUCCESS;
+}
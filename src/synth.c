@@ -0,0 +1,141 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/aes.h>
+
+#include "synth.h"
+
+#define OFFSET_MKEY1 4
+#define OFFSET_MKEY2 56
+#define OFFSET_EXPIRE_MKEY1 36
+#define OFFSET_EXPIRE_MKEY2 88
+
+#define OFFSET_CWKEYS 33
+
+#define KEYBLOCK_HDR_LEN 4
+#define KEYBLOCK_ENTRY_LEN 108
+
+uint32_t synth_rand(uint64_t * state) {
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return (x * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static void put_uint16(unsigned char * data, unsigned int value) {
+	data[0] = value & 0xff;
+	data[1] = (value >> 8) & 0xff;
+}
+
+static void put_ts(unsigned char * data, time_t ts) {
+	struct tm t;
+
+	localtime_r(&ts, &t);
+	put_uint16(data, t.tm_year + 1900);
+	put_uint16(data + 2, t.tm_mon + 1);
+	put_uint16(data + 4, t.tm_mday);
+	put_uint16(data + 6, t.tm_hour);
+	put_uint16(data + 8, t.tm_min);
+	put_uint16(data + 10, t.tm_sec);
+}
+
+/*
+ * Builds a keyblock in the layout received from the VKS: a 4 byte header
+ * followed by 108 byte entries. Master key 1 expires in one day and master
+ * key 2 in thirty, so lookups always find a valid key.
+ */
+unsigned char * synth_keyblock(unsigned int channels, uint16_t first_channel, uint64_t seed, size_t * len) {
+	unsigned char * keyblock, * token;
+	time_t now = time(NULL);
+	uint64_t rng = seed | 1;
+	unsigned int i, j;
+
+	*len = KEYBLOCK_HDR_LEN + channels * KEYBLOCK_ENTRY_LEN;
+	if ((keyblock = calloc(1, *len)) == NULL)
+		return NULL;
+
+	for (i = 0; i < channels; i++) {
+		token = keyblock + KEYBLOCK_HDR_LEN + i * KEYBLOCK_ENTRY_LEN;
+		put_uint16(token, first_channel + i);
+		for (j = 0; j < 16; j++) {
+			token[OFFSET_MKEY1 + j] = synth_rand(&rng);
+			token[OFFSET_MKEY2 + j] = synth_rand(&rng);
+		}
+		put_ts(token + OFFSET_EXPIRE_MKEY1, now + 86400);
+		put_ts(token + OFFSET_EXPIRE_MKEY2, now + 30 * 86400);
+	}
+
+	return keyblock;
+}
+
+/*
+ * Returns channel id and the master key vmcam will select for entry @index.
+ */
+void synth_keyblock_mkey(const unsigned char * keyblock, unsigned int index, time_t now, uint16_t * channel, unsigned char * mkey) {
+	const unsigned char * token = keyblock + KEYBLOCK_HDR_LEN + index * KEYBLOCK_ENTRY_LEN;
+	struct tm t;
+
+	memset(&t, 0, sizeof(t));
+	t.tm_year = (token[OFFSET_EXPIRE_MKEY1] | token[OFFSET_EXPIRE_MKEY1 + 1] << 8) - 1900;
+	t.tm_mon = (token[OFFSET_EXPIRE_MKEY1 + 2] | token[OFFSET_EXPIRE_MKEY1 + 3] << 8) - 1;
+	t.tm_mday = token[OFFSET_EXPIRE_MKEY1 + 4] | token[OFFSET_EXPIRE_MKEY1 + 5] << 8;
+	t.tm_hour = token[OFFSET_EXPIRE_MKEY1 + 6] | token[OFFSET_EXPIRE_MKEY1 + 7] << 8;
+	t.tm_min = token[OFFSET_EXPIRE_MKEY1 + 8] | token[OFFSET_EXPIRE_MKEY1 + 9] << 8;
+	t.tm_sec = token[OFFSET_EXPIRE_MKEY1 + 10] | token[OFFSET_EXPIRE_MKEY1 + 11] << 8;
+	t.tm_isdst = -1;
+
+	*channel = token[0] | token[1] << 8;
+	memcpy(mkey, token + (mktime(&t) > now ? OFFSET_MKEY1 : OFFSET_MKEY2), 16);
+}
+
+/*
+ * Builds an ECM for @table (0x80 or 0x81) which decrypts under @mkey to the
+ * "CEB" marker followed by the two control words in @cw.
+ */
+void synth_ecm(unsigned char * ECM, const unsigned char * mkey, uint16_t channel, unsigned char table, const unsigned char * cw) {
+	unsigned char plain[48];
+	AES_KEY key;
+	int t;
+
+	memset(ECM, 0, SYNTH_ECM_LEN);
+	ECM[0] = table;
+	ECM[1] = 0x70 | (((SYNTH_ECM_LEN - 3) >> 8) & 0x0f);
+	ECM[2] = (SYNTH_ECM_LEN - 3) & 0xff;
+	ECM[18] = channel >> 8;
+	ECM[19] = channel & 0xff;
+
+	memset(plain, 0, sizeof(plain));
+	memcpy(plain, "CEB", 3);
+	if (table == 0x80) {
+		memcpy(plain + OFFSET_CWKEYS - 24, cw, 32);
+	} else {
+		memcpy(plain + OFFSET_CWKEYS - 24 + 16, cw, 16);
+		memcpy(plain + OFFSET_CWKEYS - 24, cw + 16, 16);
+	}
+
+	AES_set_encrypt_key(mkey, 128, &key);
+	for (t = 0; t < 48; t += 16)
+		AES_encrypt(plain + t, ECM + 24 + t, &key);
+}
@@ -0,0 +1,31 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define SYNTH_ECM_LEN 72
+
+uint32_t synth_rand(uint64_t * state);
+
+unsigned char * synth_keyblock(unsigned int channels, uint16_t first_channel, uint64_t seed, size_t * len);
+void synth_keyblock_mkey(const unsigned char * keyblock, unsigned int index, time_t now, uint16_t * channel, unsigned char * mkey);
+
+void synth_ecm(unsigned char * ECM, const unsigned char * mkey, uint16_t channel, unsigned char table, const unsigned char * cw);
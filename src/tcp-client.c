@@ -3,7 +3,9 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <errno.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -15,22 +17,67 @@
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #endif
 
+#include "tcp-client.h"
 #include "log.h"
 
 #define RETURN_NULL(x) if ((x)==NULL) exit (1)
 #define RETURN_ERR(err,s) if (err<0) { LOG(ERROR, "[tcp-client] %s", s); return(-1); }
 #define RETURN_TCP(err) if (err<0) { LOG(ERROR, "[tcp-client] error: %d", err); return(-1);
 
-int tcp_client_send(unsigned char *msg, uint16_t msglen,
-		unsigned char*buf_received, int responsebuflen, const char *s_addr,
-		short int s_port) {
+/* Monotonic time in ns after which calls fail, zero waits forever */
+static uint64_t tcp_client_deadline;
+
+static uint64_t tcp_client_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Calls fail once @ms passed from now, however slowly the server sends */
+void tcp_client_set_deadline(int ms) {
+	tcp_client_deadline = ms > 0 ? tcp_client_now() + (uint64_t) ms * 1000000 : 0;
+}
+
+/* Bounds the next operation on @sock by the time left, -1 when it's up */
+static int tcp_client_remaining(int sock) {
+	struct timeval tv;
+	uint64_t now, left;
+
+	if (tcp_client_deadline == 0)
+		return 0;
+
+	if ((now = tcp_client_now()) >= tcp_client_deadline) {
+		LOG(ERROR, "[tcp-client] Deadline passed");
+		return -1;
+	}
+
+	left = (tcp_client_deadline - now) / 1000 + 1;	// Rounded up to us, 0 would wait forever
+	tv.tv_sec = left / 1000000;
+	tv.tv_usec = left % 1000000;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return 0;
+}
+
+static int tcp_client_socket(const struct addrinfo *ai) {
+	int sock;
+
+	if ((sock = socket(ai->ai_family, ai->ai_socktype, 0)) >= 0 && tcp_client_remaining(sock) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int tcp_client_connect(const char *s_addr, short int s_port) {
 	int err;
 	int sock;
-	int received = 0;
 	/* Use getaddrinfo to get server address */
 	char port_str[7];
 	struct addrinfo *aires;
@@ -50,32 +97,83 @@ int tcp_client_send(unsigned char *msg, uint16_t msglen,
 	err = getaddrinfo(s_addr, port_str, &hints, &aires);
 	RETURN_ERR(err, "getaddrinfo");
 
-	ai = aires;
-	for (;ai != NULL &&
-		((sock = socket(ai->ai_family, ai->ai_socktype, 0)) < 0 ||
-		(err = connect(sock, ai->ai_addr, ai->ai_addrlen)) < 0);
-		close(sock), sock = 0, ai = ai->ai_next);
+	// @sock stays -1 unless an address connected
+	sock = -1;
+	for (ai = aires; ai != NULL && sock < 0; ai = ai->ai_next) {
+		if ((sock = tcp_client_socket(ai)) >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+			close(sock);
+			sock = -1;
+		}
+	}
 
 	freeaddrinfo(aires);
 
-	RETURN_ERR(sock, "socket");
-	RETURN_ERR(err, "connect");
+	RETURN_ERR(sock, "connect");
+	return sock;
+}
 
-	err = write(sock, msg, msglen);
-	if (err < 0)
+/*
+ * Sends @msg and hands the response to @receive as it arrives, until the
+ * server closes the connection or @receive returns an error.
+ * Returns the number of bytes received or -1.
+ */
+int tcp_client_stream(unsigned char *msg, uint16_t msglen,
+		tcp_client_receiver receive, void *arg, const char *s_addr,
+		short int s_port) {
+	unsigned char buf[16384];
+	int err;
+	int sock;
+	int received = 0;
+
+	if ((sock = tcp_client_connect(s_addr, s_port)) < 0)
+		return -1;
+
+	err = tcp_client_remaining(sock) < 0 ? -1 : write(sock, msg, msglen);
+	if (err < 0) {
+		close(sock);
 		RETURN_ERR(err, "ERROR writing to socket");
+	}
 
-	do {
-		err = read(sock, &buf_received[received], 1024);
+	while ((err = tcp_client_remaining(sock) < 0 ? -1 : read(sock, buf, sizeof(buf))) > 0) {
 		received += err;
-	} while (err > 0);
+		if (receive(arg, buf, err) < 0) {
+			close(sock);
+			return -1;
+		}
+	}
+
+	/* Terminate communication on a socket */
+	close(sock);
 
 	if (err < 0)
 		RETURN_ERR(err, "ERROR reading from socket");
 
 	LOG(DEBUG, "[tcp-client] Received %d", received);
-
-	/* Terminate communication on a socket */
-	err = close(sock);
 	return received;
 }
+
+struct tcp_client_buffer {
+	unsigned char *buf;
+	int len;
+	int size;
+};
+
+static int tcp_client_copy(void *arg, const unsigned char *data, int len) {
+	struct tcp_client_buffer *b = arg;
+
+	if (len > b->size - b->len) {
+		LOG(ERROR, "[tcp-client] Response larger than %d bytes", b->size);
+		return -1;
+	}
+	memcpy(b->buf + b->len, data, len);
+	b->len += len;
+	return 0;
+}
+
+int tcp_client_send(unsigned char *msg, uint16_t msglen,
+		unsigned char*buf_received, int responsebuflen, const char *s_addr,
+		short int s_port) {
+	struct tcp_client_buffer b = {buf_received, 0, responsebuflen};
+
+	return tcp_client_stream(msg, msglen, tcp_client_copy, &b, s_addr, s_port);
+}
@@ -8,8 +8,14 @@
 #ifndef TCP_CLIENT_H_
 #define TCP_CLIENT_H_
 
+typedef int (*tcp_client_receiver)(void *arg, const unsigned char *data, int len);
+
+int tcp_client_stream(unsigned char *msg, uint16_t msglen,
+		tcp_client_receiver receive, void *arg, const char *s_addr,
+		short int s_port);
 int tcp_client_send(unsigned char *msg, uint16_t msglen,
 		unsigned char*buf_received, int responselen, const char *s_addr,
 		short int s_port);
+void tcp_client_set_deadline(int ms);
 
 #endif /* SSL_CLIENT_H_ */
@@ -0,0 +1,247 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_IO_URING
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "log.h"
+
+static int sys_setup(unsigned int entries, struct io_uring_params * p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags) {
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned int op, void * arg, unsigned int count) {
+	return syscall(__NR_io_uring_register, fd, op, arg, count);
+}
+
+/*
+ * Creates a ring with @entries submission and four times as many
+ * completion entries, multishot receives can complete a lot per submit.
+ * Single issuer with deferred task work is used when the kernel has it.
+ */
+int uring_init(struct uring * r, unsigned int entries) {
+	struct io_uring_params p;
+	unsigned char * ring;
+	size_t cq_len;
+
+	memset(r, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	p.cq_entries = entries * 4;
+	if ((r->fd = sys_setup(entries, &p)) < 0 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = entries * 4;
+		r->fd = sys_setup(entries, &p);
+	}
+	if (r->fd < 0)
+		return -1;
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+		close(r->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	r->ring_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > r->ring_map_len)
+		r->ring_map_len = cq_len;
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->ring_map = mmap(NULL, r->ring_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->ring_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+		uring_exit(r);
+		return -1;
+	}
+
+	ring = r->ring_map;
+	r->sq_head = (unsigned int *) (ring + p.sq_off.head);
+	r->sq_tail = (unsigned int *) (ring + p.sq_off.tail);
+	r->sq_array = (unsigned int *) (ring + p.sq_off.array);
+	r->sq_mask = *(unsigned int *) (ring + p.sq_off.ring_mask);
+	r->cq_head = (unsigned int *) (ring + p.cq_off.head);
+	r->cq_tail = (unsigned int *) (ring + p.cq_off.tail);
+	r->cq_mask = *(unsigned int *) (ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+	return 0;
+}
+
+void uring_exit(struct uring * r) {
+	if (r->sqes != NULL && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_len);
+	if (r->ring_map != NULL && r->ring_map != MAP_FAILED)
+		munmap(r->ring_map, r->ring_map_len);
+	if (r->br != NULL)
+		munmap(r->br, (r->br_mask + 1) * sizeof(struct io_uring_buf));
+	free(r->bufs);
+	close(r->fd);
+	memset(r, 0, sizeof(struct uring));
+	r->fd = -1;
+}
+
+/*
+ * Registers @count (a power of two) receive buffers of @size bytes as
+ * buffer group @group. Receives with IOSQE_BUFFER_SELECT pick one of them
+ * and report its id in the completion flags.
+ */
+int uring_setup_buffers(struct uring * r, unsigned short group, unsigned int count, unsigned int size) {
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	r->br = mmap(NULL, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->br == MAP_FAILED) {
+		r->br = NULL;
+		return -1;
+	}
+	r->br_mask = count - 1;
+	if ((r->bufs = malloc((size_t) count * size)) == NULL)
+		return -1;
+	r->buf_size = size;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) r->br;
+	reg.ring_entries = count;
+	reg.bgid = group;
+	if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -1;
+
+	for (i = 0; i < count; i++)
+		uring_recycle_buffer(r, i);
+	return 0;
+}
+
+unsigned char * uring_buffer(struct uring * r, unsigned short bid) {
+	return r->bufs + (size_t) bid * r->buf_size;
+}
+
+void uring_recycle_buffer(struct uring * r, unsigned short bid) {
+	struct io_uring_buf * buf = &r->br->bufs[r->br_tail & r->br_mask];
+
+	buf->addr = (unsigned long) uring_buffer(r, bid);
+	buf->len = r->buf_size;
+	buf->bid = bid;
+	__atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns a cleared SQE, submitting what is queued first when the
+ * submission queue is full.
+ */
+struct io_uring_sqe * uring_get_sqe(struct uring * r) {
+	struct io_uring_sqe * sqe;
+	unsigned int tail = *r->sq_tail + r->sq_pending;
+
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > r->sq_mask) {
+		if (uring_submit(r, 0) < 0)
+			return NULL;
+		tail = *r->sq_tail;
+		if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > r->sq_mask)
+			return NULL;
+	}
+
+	sqe = &r->sqes[tail & r->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	r->sq_array[tail & r->sq_mask] = tail & r->sq_mask;
+	r->sq_pending++;
+	return sqe;
+}
+
+/*
+ * Submits all queued SQEs and waits for at least @wait completions in
+ * the same system call.
+ */
+int uring_submit(struct uring * r, unsigned int wait) {
+	unsigned int submit = r->sq_pending;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, *r->sq_tail + submit, __ATOMIC_RELEASE);
+	r->sq_pending = 0;
+
+	do {
+		ret = sys_enter(r->fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR && wait == 0);
+
+	return ret;
+}
+
+struct io_uring_cqe * uring_peek_cqe(struct uring * r) {
+	unsigned int head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring * r) {
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Checks the kernel has everything the server backend uses by doing a
+ * multishot receive into a provided buffer over a socket pair. Multishot
+ * receive is the newest of the needed features (Linux 6.0).
+ */
+int uring_supported(void) {
+	struct uring r;
+	struct io_uring_sqe * sqe;
+	struct io_uring_cqe * cqe;
+	int sv[2];
+	int ok = 0;
+
+	if (uring_init(&r, 8) < 0)
+		return 0;
+
+	if (uring_setup_buffers(&r, 0, 4, 64) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		uring_exit(&r);
+		return 0;
+	}
+
+	sqe = uring_get_sqe(&r);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sv[0];
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+
+	if (write(sv[1], "x", 1) == 1 && uring_submit(&r, 1) >= 0 && (cqe = uring_peek_cqe(&r)) != NULL)
+		ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE);
+
+	close(sv[0]);
+	close(sv[1]);
+	uring_exit(&r);
+	return ok;
+}
+
+#endif /* HAVE_IO_URING */
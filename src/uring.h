@@ -0,0 +1,69 @@
+/**
+ * Copyright (c) 2014 Iwan Timmer
+ * 
+ * This file is part of VMCam.
+ * 
+ * VMCam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * VMCam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#ifdef HAVE_IO_URING
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring ring handling on top of the raw system calls: one
+ * submission and completion queue plus a ring of provided receive buffers.
+ * A ring must only be used by the thread which created it.
+ */
+struct uring {
+	int fd;
+	unsigned int * sq_head;
+	unsigned int * sq_tail;
+	unsigned int * sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_pending;	// SQEs filled but not yet submitted
+	struct io_uring_sqe * sqes;
+	unsigned int * cq_head;
+	unsigned int * cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe * cqes;
+	void * ring_map;		// Both queues share one mapping
+	size_t ring_map_len;
+	size_t sqes_len;
+
+	struct io_uring_buf_ring * br;
+	unsigned int br_mask;
+	unsigned short br_tail;
+	unsigned int buf_size;
+	unsigned char * bufs;
+};
+
+int uring_supported(void);
+int uring_init(struct uring * r, unsigned int entries);
+void uring_exit(struct uring * r);
+int uring_setup_buffers(struct uring * r, unsigned short group, unsigned int count, unsigned int size);
+unsigned char * uring_buffer(struct uring * r, unsigned short bid);
+void uring_recycle_buffer(struct uring * r, unsigned short bid);
+struct io_uring_sqe * uring_get_sqe(struct uring * r);
+int uring_submit(struct uring * r, unsigned int wait);
+struct io_uring_cqe * uring_peek_cqe(struct uring * r);
+void uring_cqe_seen(struct uring * r);
+
+#endif /* HAVE_IO_URING */
+
+#endif /* URING_H_ */
@@ -2,6 +2,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <err.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "log.h"
 
@@ -19,3 +21,24 @@ char * str_realloc_copy(char ** dest, char * src) {
 	strncpy(*dest, src, len + 1);
         return *dest;
 }
+
+/*
+ * Blocking read of exactly @len bytes, returns @len or -1 on EOF or error.
+ */
+ssize_t read_full(int fd, void * buf, size_t len) {
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, (char *) buf + done, len - done);
+		if (n == 0)
+			return -1;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
@@ -1,2 +1,5 @@
+#include <sys/types.h>
+
 
 char * str_realloc_copy(char ** dest, char * src);
+ssize_t read_full(int fd, void * buf, size_t len);
@@ -42,6 +42,7 @@
 #include <net/if_arp.h>
 
 #include "vm_api.h"
+#include "keyblock.h"
 #include "ssl-client.h"
 #include "tcp-client.h"
 #include "base64.h"
@@ -49,7 +50,7 @@
 #include "var_func.h"
 
 #define uchar unsigned char
-#define GETKEYS_BUFFSIZE (1024 * 100)
+#define GETKEYS_HDR_LEN 4
 
 #define RETURN_ERR(s) LOG(ERROR, "[API] %s", s); goto cleanup;
 
@@ -84,6 +85,9 @@ uchar * session_key = NULL;
 uchar * timestamp = NULL;
 char * ski = NULL;
 
+// Keyblock fetched by GetAllChannelKeys, waiting to be published
+struct keyblock_builder * keys_pending = NULL;
+
 // Files used
 char * f_signedcert = NULL;
 char * f_csr = NULL;
@@ -91,6 +95,20 @@ char * f_rsa_private_key = NULL;
 char * f_keyblock = NULL;
 char * f_dir = NULL;
 
+// Credentials kept in memory between refreshes, reloaded when their file changes
+struct file_stamp {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+
+static EVP_PKEY * rsa_pkey = NULL;
+static EVP_PKEY_CTX * rsa_sign_ctx = NULL;
+static struct file_stamp rsa_pkey_stamp;
+static char ski_buf[40 + 1];
+static struct file_stamp ski_stamp;
+
 char* strconcat(char* str1, char* str2) {
 	int length = strlen(str1) + strlen(str2) + 1;
 	char* result = malloc(length);
@@ -219,42 +237,103 @@ int generate_rsa_pkey() {
 	LOG(VERBOSE, "[API] Private key created:%s", pem_key);
 
 	BIO_free_all(bio);
+	RSA_free(rsa_priv_key);
 	free(pem_key);
         pem_key = NULL;
 	return 0;
 }
 
-int load_rsa_pkey(RSA ** rsa_priv_key) {
+/**
+ * file_changed() compares @path with the @stamp of the last load
+ * @return int 1 and updates @stamp when changed, 0 when not, -1 when missing
+ */
+static int file_changed(const char * path, struct file_stamp * stamp) {
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		memset(stamp, 0, sizeof(*stamp));
+		return -1;
+	}
+
+	if (st.st_dev == stamp->dev && st.st_ino == stamp->ino && st.st_size == stamp->size &&
+			st.st_mtim.tv_sec == stamp->mtime.tv_sec && st.st_mtim.tv_nsec == stamp->mtime.tv_nsec)
+		return 0;
+
+	stamp->dev = st.st_dev;
+	stamp->ino = st.st_ino;
+	stamp->size = st.st_size;
+	stamp->mtime = st.st_mtim;
+	return 1;
+}
+
+static void free_rsa_pkey(void) {
+	EVP_PKEY_CTX_free(rsa_sign_ctx);
+	EVP_PKEY_free(rsa_pkey);
+	rsa_sign_ctx = NULL;
+	rsa_pkey = NULL;
+}
+
+/*
+ * Private key with its signing context, read once and again only when
+ * the file changed. A new key is generated when there is none.
+ */
+static EVP_PKEY * load_rsa_pkey(void) {
 	FILE *fp;
+	EVP_PKEY * pkey;
+	int changed;
+
+	if ((changed = file_changed(f_rsa_private_key, &rsa_pkey_stamp)) < 0) {
+		LOG(DEBUG, "[API] No private key found, generating new key");
+		if (generate_rsa_pkey() < 0 || (changed = file_changed(f_rsa_private_key, &rsa_pkey_stamp)) < 0)
+			return NULL;
+	}
+
+	if (changed == 0 && rsa_pkey != NULL)
+		return rsa_pkey;
+
 	// Read PEM Private Key
 	fp = fopen(f_rsa_private_key, "r");
-	if (fp) {
-		LOG(DEBUG, "[API] Private key found");
-		*rsa_priv_key = PEM_read_RSAPrivateKey(fp, NULL, NULL, NULL);
-	} else {
-                LOG(DEBUG, "[API] No private key found, generating new key");
-                if (generate_rsa_pkey() < 0)
-			return -1;
+	if (fp == NULL)
+		goto fail;
 
-		fp = fopen(f_rsa_private_key, "r");
-		*rsa_priv_key = PEM_read_RSAPrivateKey(fp, NULL, NULL, NULL);
-	}
+	pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
 	fclose(fp);
-	return 0;
+	if (pkey == NULL)
+		goto fail;
+
+	free_rsa_pkey();
+	rsa_pkey = pkey;
+
+	// Timestamps are signed like RSA_sign(NID_md5), PKCS#1 v1.5 over the MD5 hash
+	rsa_sign_ctx = EVP_PKEY_CTX_new(rsa_pkey, NULL);
+	if (rsa_sign_ctx == NULL || EVP_PKEY_sign_init(rsa_sign_ctx) <= 0 ||
+			EVP_PKEY_CTX_set_rsa_padding(rsa_sign_ctx, RSA_PKCS1_PADDING) <= 0 ||
+			EVP_PKEY_CTX_set_signature_md(rsa_sign_ctx, EVP_md5()) <= 0) {
+		free_rsa_pkey();
+		goto fail;
+	}
+
+	LOG(DEBUG, "[API] Private key loaded");
+	return rsa_pkey;
+fail:
+	LOG(ERROR, "[API] Unable to load private key from %s", f_rsa_private_key);
+	memset(&rsa_pkey_stamp, 0, sizeof(rsa_pkey_stamp));
+	return NULL;
 }
 
 int generate_signed_hash(uchar ** signed_hash) {
-	RSA * rsa_priv_key;
 	uchar md5hash[MD5_DIGEST_LENGTH];
 	uchar buf[129];
+	size_t n = sizeof(buf);
 	*signed_hash = calloc(257, 1);
 	MD5(timestamp, 19, md5hash);
-	unsigned int n = 0;
-	if (load_rsa_pkey(&rsa_priv_key) < 0)
+	if (load_rsa_pkey() == NULL)
 		return -1;
 
-	RSA_sign(NID_md5, md5hash, MD5_DIGEST_LENGTH, buf, &n, rsa_priv_key);
-	OPENSSL_free(rsa_priv_key);
+	if (EVP_PKEY_sign(rsa_sign_ctx, buf, &n, md5hash, MD5_DIGEST_LENGTH) <= 0) {
+		LOG(ERROR, "[API] Unable to sign timestamp");
+		return -1;
+	}
 
 	int i, j = 0;
 	for (i = 0; i < 128; i++) {
@@ -265,7 +344,6 @@ int generate_signed_hash(uchar ** signed_hash) {
 
 int generate_csr(char** pem_csr) {
 	FILE* fp;
-	RSA * rsa_priv_key;
 	int ret = 0;
 	int nVersion = 0;
 	int keylen = 0;
@@ -334,12 +412,9 @@ int generate_csr(char** pem_csr) {
 	}
 
 	// 4. set public key of x509 req
-	if (load_rsa_pkey(&rsa_priv_key) < 0)
+	if ((pKey = load_rsa_pkey()) == NULL)
 		goto free_all;
 
-	pKey = EVP_PKEY_new();
-	EVP_PKEY_assign_RSA(pKey, rsa_priv_key);
-
 	ret = X509_REQ_set_pubkey(x509_req, pKey);
 	if (ret != 1) {
 		goto free_all;
@@ -373,33 +448,49 @@ int generate_csr(char** pem_csr) {
 	return (keylen);
 }
 
+/*
+ * SKI of the signed certificate, parsed once and again only when the
+ * certificate file changed.
+ */
 int generate_ski_string() {
 	FILE *fp;
-	int i, j = 0, loc = 0;
-	char* buf2 = ski = calloc(40 + 1, 1);
-	X509 * signed_cert = 0;
-	X509_EXTENSION *ext;
-        
+	int i, j = 0, loc, changed;
+	X509 * signed_cert = NULL;
+	const ASN1_OCTET_STRING * value = NULL;
+	const uchar * data;
+
+	if ((changed = file_changed(f_signedcert, &ski_stamp)) < 0) { 	//Create new one
+		ski = NULL;
+		return -1;
+	}
+
+	if (changed == 0 && ski != NULL)
+		return strlen(ski) + 2;
+
+	ski = NULL;
 	fp = fopen(f_signedcert, "r");
 	if (fp) {
-		signed_cert = d2i_X509_fp(fp, &signed_cert);
+		signed_cert = d2i_X509_fp(fp, NULL);
 		fclose(fp);
-	} else { 	//Create new one
-		return -1;
 	}
 
-	loc = X509_get_ext_by_NID(signed_cert, NID_subject_key_identifier, -1);
-	ext = X509_get_ext(signed_cert, loc);
+	if (signed_cert != NULL && (loc = X509_get_ext_by_NID(signed_cert, NID_subject_key_identifier, -1)) >= 0)
+		value = X509_EXTENSION_get_data(X509_get_ext(signed_cert, loc));
 
-	OPENSSL_free(signed_cert);
-
-	if (ext == NULL) {
+	// Extension value is the DER octet string of the 20 byte key identifier
+	if (value == NULL || ASN1_STRING_length(value) < 22) {
+		X509_free(signed_cert);
+		memset(&ski_stamp, 0, sizeof(ski_stamp));
 		return -1;
 	}
 
+	data = ASN1_STRING_get0_data(value);
 	for (i = 2; i < 22; i++) {
-		j += sprintf(buf2 + j, "%02X", ext->value->data[i]);
+		j += sprintf(ski_buf + j, "%02X", data[i]);
 	}
+	X509_free(signed_cert);
+
+	ski = ski_buf;
 	return j + 2;
 }
 
@@ -472,6 +563,7 @@ int API_GetCertificate() {
 	fp = fopen(f_signedcert, "w");
 	fwrite(cert, response_len - 12, 1, fp);
 	fclose(fp);
+	memset(&ski_stamp, 0, sizeof(ski_stamp));
 
 	free(response_buffer);
 	free(csr);
@@ -587,21 +679,46 @@ int API_GetEncryptedPassword() {
 	return 0;
 }
 
+/*
+ * The keyblock is decrypted and parsed while it's received, so only the
+ * index and one partial entry are held in memory. The snapshot in the
+ * cache directory is written alongside.
+ */
+struct keys_stream {
+	RC4_KEY rc4key;
+	int skip;				// Response header bytes still to skip
+	struct keyblock_builder * builder;
+};
+
+static int keys_receive(void * arg, const unsigned char * data, int len) {
+	struct keys_stream * stream = arg;
+	uchar buf[16384];
+	int n;
+
+	if (stream->skip > 0) {
+		n = stream->skip < len ? stream->skip : len;
+		stream->skip -= n;
+		data += n;
+		len -= n;
+	}
+
+	for (; len > 0; data += n, len -= n) {
+		n = len < (int) sizeof(buf) ? len : (int) sizeof(buf);
+		RC4(&stream->rc4key, n, data, buf);
+		if (keyblock_builder_add(stream->builder, buf, n) < 0)
+			return -1;
+	}
+	return 0;
+}
+
 int API_GetAllChannelKeys() {
 	uchar * signedhash = 0;
 	char* msg = malloc(512);
-	uchar * response_buffer = calloc(GETKEYS_BUFFSIZE, 1);
-	uchar * keyblock;
+	struct keys_stream stream;
 	int msglen, retlen, plainlen;
 	RC4_KEY rc4key;
-	FILE * fp;
 	char* unencryptedAPICompare = malloc(128);
 
-	if (response_buffer == NULL) {
-		LOG(ERROR, "[API] GetAllChannelKeys failed, unable to allocate memory");
-		return -1;
-	}
-
 	sprintf((char*) unencryptedAPICompare, "%s~%s~%s~",
 			api_company, timestamp, api_machineID);
         plainlen = addHeader(&unencryptedAPICompare, api_msgformat);
@@ -623,36 +740,48 @@ int API_GetAllChannelKeys() {
 	RC4_set_key(&rc4key, 16, session_key);
 	RC4(&rc4key, msglen - plainlen, msg + plainlen, msg + plainlen);
 
-	retlen = tcp_client_send(msg, msglen, response_buffer, GETKEYS_BUFFSIZE,
+	keyblock_builder_free(keys_pending);
+	keys_pending = NULL;
+
+	stream.builder = keyblock_builder_new(f_keyblock, time(NULL));
+	if (stream.builder == NULL) {
+		LOG(ERROR, "[API] GetAllChannelKeys failed, unable to allocate memory");
+		free(msg);
+		return -1;
+	}
+	stream.skip = GETKEYS_HDR_LEN;
+	RC4_set_key(&stream.rc4key, 16, session_key);
+
+	retlen = tcp_client_stream(msg, msglen, keys_receive, &stream,
 	vksServerAddress, VKS_Port_SSL);
         free(msg);
 	if (retlen < 10) {
-		free(response_buffer);
-                response_buffer = NULL;
+		keyblock_builder_free(stream.builder);
 		return -1;
 	}
 
-	keyblock = response_buffer + 4;
-	retlen -= 4;
+	LOG(INFO, "[API] GetAllChannelKeys completed, size: %d", retlen - GETKEYS_HDR_LEN);
 
-	LOG(INFO, "[API] GetAllChannelKeys completed, size: %d", retlen);
+	keys_pending = stream.builder;
+	return 0;
+}
 
-	RC4_set_key(&rc4key, 16, session_key);
-	RC4(&rc4key, retlen, keyblock, keyblock);
+/**
+ * vm_publish_keyblock() makes the keyblock of the last GetAllChannelKeys
+ * the one ECMs are decrypted with and commits its snapshot in the cache
+ * directory
+ */
+int vm_publish_keyblock(void) {
+	int ret;
 
-	fp = fopen(f_keyblock, "w");
-	if (fp) {
-		fwrite(keyblock, retlen, 1, fp);
-		fclose(fp);
-		free(response_buffer);
-                response_buffer = NULL;
-		return 0;
-	} else {
-		LOG(ERROR, "[API] GetAllChannelKeys failed, could not write keyblock to %s", f_keyblock);	
-	}
-	free(response_buffer);
-        response_buffer = NULL;
-	return -1;
+	if (keys_pending == NULL)
+		return -1;
+
+	if ((ret = keyblock_builder_finish(keys_pending)) < 0)
+		LOG(ERROR, "[API] GetAllChannelKeys failed, received keyblock is invalid");
+
+	keys_pending = NULL;
+	return ret;
 }
 
 int init_vmapi() {
@@ -687,65 +816,30 @@ cleanup:
 	return exit_code;
 }
 
-int load_keyblock(void) {
-	int exit_code = EXIT_FAILURE;
-	char retry_count = 0, res, t = 0;
-
-retry:
-	// Get Session key from server
-	while(API_GetSessionKey() != 0) {
-		if (t > 2) {
-			RETURN_ERR("GetSessionKey failed");
-		}
-		sleep(1);
-		t++;
-	}
-	// Give the server some time
-	usleep(500 * 1000);
-
-	// Read X509 Signed Certificate, if not present or when SKI could not be retrieved request new one
-	if (generate_ski_string() < 0) {
-		if (API_GetCertificate() < 0) {
-			RETURN_ERR("Unable to get Signed Certificate");
-		}
-		if (generate_ski_string() < 0) {
-			RETURN_ERR("Got a Signed Certificate but unable to get SKI");
-		}
-		if (API_SaveEncryptedPassword() < 0) {
-			RETURN_ERR("Unable to save encrypted password");
-		}
-	} else {
-		if (API_GetEncryptedPassword() < 0) {
-			RETURN_ERR("Unable to get encrypted password");
-		}
-	}
-
-	LOG(DEBUG, "[API] Using Subject Key Identifier: %s", ski);
-
-	// Give the server some time
-	sleep(1);
-
-	// Get the Master Keys
-	if(API_GetAllChannelKeys() < 0) {
-		LOG(ERROR, "[API] GetAllChannelKeys failed");
-		if(retry_count < 2){
-			retry_count += 1;
-			LOG(INFO, "[API] Will cleanup and retry in 5 seconds... Retry count: %d", retry_count);
-			res = remove(f_signedcert);
-			res += remove(f_rsa_private_key);
-			res += remove(f_csr);
-			if(res == 0) {
-				sleep(5);
-				goto retry;
-			} else {
-				RETURN_ERR("Unable to remove files, please remove manually");
-			}
-		}
-		goto cleanup;
-	}
-
-	exit_code = EXIT_SUCCESS;
-cleanup:
+int load_keyblock_file(time_t * fetched) {
+	return keyblock_load_file(f_keyblock, fetched);
+}
+
+// Files of the certificate, a new one is requested on the next refresh
+int vm_remove_certificate(void) {
+	int res;
+
+	free_rsa_pkey();
+	memset(&rsa_pkey_stamp, 0, sizeof(rsa_pkey_stamp));
+	memset(&ski_stamp, 0, sizeof(ski_stamp));
+	ski = NULL;
+
+	res = remove(f_signedcert);
+	res += remove(f_rsa_private_key);
+	res += remove(f_csr);
+	if (res != 0) {
+		LOG(ERROR, "[API] Unable to remove files, please remove manually");
+		return -1;
+	}
+	return 0;
+}
+
+void vm_end_session(void) {
 	if (session_key) {
 		free(session_key);
                 session_key = NULL;
@@ -754,6 +848,4 @@ cleanup:
 		free(timestamp);
                 timestamp = NULL;
 	}
-
-	return exit_code;
 }
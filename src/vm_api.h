@@ -17,10 +17,22 @@
  * along with VMCam.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-unsigned int key_interval;
+#include <time.h>
+
 
 void vm_config(char* vcas_address, unsigned int vcas_port, char* vks_address,
         unsigned int vks_port, char* company, char* dir, char* amino_mac,
         char* machine_id, int protocolVersion);
 int init_vmapi();
-int load_keyblock(void);
+int load_keyblock_file(time_t * fetched);
+
+// Steps of a keyblock refresh, run in order by refresh.c
+int API_GetSessionKey();
+int generate_ski_string();
+int API_GetCertificate();
+int API_SaveEncryptedPassword();
+int API_GetEncryptedPassword();
+int API_GetAllChannelKeys();
+int vm_publish_keyblock(void);
+int vm_remove_certificate(void);
+void vm_end_session(void);